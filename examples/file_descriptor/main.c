@@ -26,35 +26,18 @@
  * This file is part of the Monolinux C library project.
  */
 
-#include <unistd.h>
-#include <stdlib.h>
 #include <stdio.h>
-#include <sys/eventfd.h>
+#include <poll.h>
 #include "ml/ml.h"
 
 /* Message ids. */
 static ML_UID(timeout);
 
-static void event_write(int *event_fd_p)
-{
-    uint64_t value;
-    ssize_t size;
-
-    value = 1;
-    size = write(*event_fd_p, &value, sizeof(value));
-
-    if (size != sizeof(value)) {
-        exit(1);
-    }
-}
-
 int main()
 {
     struct ml_timer_t timer;
     struct ml_queue_t queue;
-    int event_fd;
-    uint64_t value;
-    ssize_t size;
+    struct pollfd fds[1];
     struct ml_uid_t *uid_p;
     void *message_p;
 
@@ -62,33 +45,30 @@ int main()
     ml_queue_init(&queue, 16);
     ml_timer_init(&timer, &timeout, &queue);
 
-    event_fd = eventfd(0, EFD_SEMAPHORE);
+    /* Readable when the queue is not empty. */
+    fds[0].fd = ml_queue_get_fd(&queue);
+    fds[0].events = POLLIN;
 
-    if (event_fd == -1) {
+    if (fds[0].fd == -1) {
         return (1);
     }
 
-    ml_queue_set_on_put(&queue,
-                        (ml_queue_put_t)event_write,
-                        &event_fd);
     ml_timer_start(&timer, 1000, 1000);
 
     while (true) {
-        size = read(event_fd, &value, sizeof(value));
-
-        if (size != sizeof(value)) {
+        if (poll(&fds[0], 1, -1) != 1) {
             continue;
         }
 
-        uid_p = ml_queue_get(&queue, (void **)&message_p);
+        while ((uid_p = ml_queue_try_get(&queue, &message_p)) != NULL) {
+            if (uid_p == &timeout) {
+                printf("Timer expired.\n");
+            } else {
+                printf("Unknown message.\n");
+            }
 
-        if (uid_p == &timeout) {
-            printf("Timer expired.\n");
-        } else {
-            printf("Unknown message.\n");
+            ml_message_free(message_p);
         }
-
-        ml_message_free(message_p);
     }
 
     return (0);
@@ -0,0 +1,127 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019, Erik Moqvist
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * This file is part of the Monolinux C library project.
+ */
+
+/*
+ * Measures the cost of sharing and freeing a message that is shared
+ * by all threads, as done by ml_broadcast() when the bus fans a
+ * message out to many queues. Run with the maximum number of threads
+ * as argument, defaulting to the number of online CPUs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "ml/ml.h"
+
+#define ITERATIONS 1000000
+
+static ML_UID(shared);
+
+static void *message_p;
+static pthread_barrier_t barrier;
+
+static void *benchmark_main(void *arg_p)
+{
+    int i;
+
+    (void)arg_p;
+
+    pthread_barrier_wait(&barrier);
+
+    for (i = 0; i < ITERATIONS; i++) {
+        ml_message_share(message_p, 1);
+        ml_message_free(message_p);
+    }
+
+    return (NULL);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+static void benchmark(int number_of_threads)
+{
+    pthread_t *pthreads_p;
+    double start;
+    double elapsed;
+    int i;
+
+    pthreads_p = xmalloc(sizeof(*pthreads_p) * (size_t)number_of_threads);
+    pthread_barrier_init(&barrier, NULL, (unsigned)number_of_threads + 1);
+
+    for (i = 0; i < number_of_threads; i++) {
+        pthread_create(&pthreads_p[i], NULL, benchmark_main, NULL);
+    }
+
+    start = now();
+    pthread_barrier_wait(&barrier);
+
+    for (i = 0; i < number_of_threads; i++) {
+        pthread_join(pthreads_p[i], NULL);
+    }
+
+    elapsed = now() - start;
+    pthread_barrier_destroy(&barrier);
+    free(pthreads_p);
+
+    printf("%7d %13.1f %17.1f\n",
+           number_of_threads,
+           1e9 * elapsed / ITERATIONS,
+           (double)number_of_threads * ITERATIONS / elapsed / 1e6);
+}
+
+int main(int argc, const char *argv[])
+{
+    int number_of_threads;
+    int i;
+
+    if (argc == 2) {
+        number_of_threads = atoi(argv[1]);
+    } else {
+        number_of_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    message_p = ml_message_alloc(&shared, 0);
+
+    printf("Threads  ns/iteration  Mshare+free/s\n");
+
+    for (i = 1; i <= number_of_threads; i++) {
+        benchmark(i);
+    }
+
+    ml_message_free(message_p);
+
+    return (0);
+}
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <poll.h>
 #include <net/if.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -44,6 +45,14 @@
 
 #define EGENERAL  1000
 
+/* Used to keep frequently written fields apart. */
+#define ML_CACHE_LINE_SIZE 64
+
+/* Timer wheel dimensions. */
+#define ML_TIMER_WHEEL_LEVELS 6
+#define ML_TIMER_WHEEL_SLOTS_BITS 6
+#define ML_TIMER_WHEEL_SLOTS (1 << ML_TIMER_WHEEL_SLOTS_BITS)
+
 /**
  * Create a unique identifier.
  */
@@ -61,33 +70,80 @@
 #define ML_LOG_INFO        6
 #define ML_LOG_DEBUG       7
 
+/* Log entries with a level above this are removed at compile time,
+   and their arguments are never evaluated. Define it, for example as
+   ML_LOG_INFO, before including this file or with -D. */
+#ifndef ML_LOG_LEVEL_MAX
+#    define ML_LOG_LEVEL_MAX ML_LOG_DEBUG
+#endif
+
+/* Arguments are only evaluated if the log object is enabled for
+   given level. The log object is evaluated once. */
+#define ML_LOG_OBJECT_PRINT(log_object_p, log_level, fmt_p, ...)        \
+    do {                                                                \
+        if ((log_level) <= ML_LOG_LEVEL_MAX) {                          \
+            struct ml_log_object_t *ml_log_object_macro_p;              \
+                                                                        \
+            ml_log_object_macro_p = (log_object_p);                     \
+                                                                        \
+            if (__builtin_expect(                                       \
+                    (log_level) <= ml_log_object_macro_p->level, 0)) {  \
+                ml_log_object_print(ml_log_object_macro_p,              \
+                                    log_level,                          \
+                                    fmt_p,                              \
+                                    ##__VA_ARGS__);                     \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+#define ML_LOG_OBJECT_HEXDUMP(log_object_p, log_level, buf_p, size)     \
+    do {                                                                \
+        if ((log_level) <= ML_LOG_LEVEL_MAX) {                          \
+            struct ml_log_object_t *ml_log_object_macro_p;              \
+                                                                        \
+            ml_log_object_macro_p = (log_object_p);                     \
+                                                                        \
+            if (__builtin_expect(                                       \
+                    (log_level) <= ml_log_object_macro_p->level, 0)) {  \
+                ml_log_object_hexdump(ml_log_object_macro_p,            \
+                                      log_level,                        \
+                                      buf_p,                            \
+                                      size);                            \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
 /* Requires "self_p->log_object". */
 #define ML_EMERGENCY(fmt_p, ...)                                        \
-    ml_log_object_print(&self_p->log_object, ML_LOG_EMERGENCY, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_EMERGENCY, fmt_p, ##__VA_ARGS__)
 #define ML_ALERT(fmt_p, ...)                              \
-    ml_log_object_print(&self_p->log_object, ML_LOG_ALERT, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_ALERT, fmt_p, ##__VA_ARGS__)
 #define ML_CRITICAL(fmt_p, ...)                           \
-    ml_log_object_print(&self_p->log_object, ML_LOG_CRITICAL, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_CRITICAL, fmt_p, ##__VA_ARGS__)
 #define ML_ERROR(fmt_p, ...)                              \
-    ml_log_object_print(&self_p->log_object, ML_LOG_ERROR, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_ERROR, fmt_p, ##__VA_ARGS__)
 #define ML_WARNING(fmt_p, ...)                            \
-    ml_log_object_print(&self_p->log_object, ML_LOG_WARNING, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_WARNING, fmt_p, ##__VA_ARGS__)
 #define ML_NOTICE(fmt_p, ...)                             \
-    ml_log_object_print(&self_p->log_object, ML_LOG_NOTICE, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_NOTICE, fmt_p, ##__VA_ARGS__)
 #define ML_INFO(fmt_p, ...)                               \
-    ml_log_object_print(&self_p->log_object, ML_LOG_INFO, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_INFO, fmt_p, ##__VA_ARGS__)
 #define ML_DEBUG(fmt_p, ...)                              \
-    ml_log_object_print(&self_p->log_object, ML_LOG_DEBUG, fmt_p, ##__VA_ARGS__)
+    ML_LOG_OBJECT_PRINT(&self_p->log_object, ML_LOG_DEBUG, fmt_p, ##__VA_ARGS__)
+#define ML_HEXDUMP(level, buf_p, size)                    \
+    ML_LOG_OBJECT_HEXDUMP(&self_p->log_object, level, buf_p, size)
 
 /* Default log object. */
-#define ml_emergency(fmt_p, ...) ml_log_print(ML_LOG_EMERGENCY, fmt_p, ##__VA_ARGS__)
-#define ml_alert(fmt_p, ...) ml_log_print(ML_LOG_ALERT, fmt_p, ##__VA_ARGS__)
-#define ml_critical(fmt_p, ...) ml_log_print(ML_LOG_CRITICAL, fmt_p, ##__VA_ARGS__)
-#define ml_error(fmt_p, ...) ml_log_print(ML_LOG_ERROR, fmt_p, ##__VA_ARGS__)
-#define ml_warning(fmt_p, ...) ml_log_print(ML_LOG_WARNING, fmt_p, ##__VA_ARGS__)
-#define ml_notice(fmt_p, ...) ml_log_print(ML_LOG_NOTICE, fmt_p, ##__VA_ARGS__)
-#define ml_info(fmt_p, ...) ml_log_print(ML_LOG_INFO, fmt_p, ##__VA_ARGS__)
-#define ml_debug(fmt_p, ...) ml_log_print(ML_LOG_DEBUG, fmt_p, ##__VA_ARGS__)
+#define ML_LOG_PRINT(level, fmt_p, ...)                                 \
+    ML_LOG_OBJECT_PRINT(&ml_log_default_object, level, fmt_p, ##__VA_ARGS__)
+#define ml_emergency(fmt_p, ...) ML_LOG_PRINT(ML_LOG_EMERGENCY, fmt_p, ##__VA_ARGS__)
+#define ml_alert(fmt_p, ...) ML_LOG_PRINT(ML_LOG_ALERT, fmt_p, ##__VA_ARGS__)
+#define ml_critical(fmt_p, ...) ML_LOG_PRINT(ML_LOG_CRITICAL, fmt_p, ##__VA_ARGS__)
+#define ml_error(fmt_p, ...) ML_LOG_PRINT(ML_LOG_ERROR, fmt_p, ##__VA_ARGS__)
+#define ml_warning(fmt_p, ...) ML_LOG_PRINT(ML_LOG_WARNING, fmt_p, ##__VA_ARGS__)
+#define ml_notice(fmt_p, ...) ML_LOG_PRINT(ML_LOG_NOTICE, fmt_p, ##__VA_ARGS__)
+#define ml_info(fmt_p, ...) ML_LOG_PRINT(ML_LOG_INFO, fmt_p, ##__VA_ARGS__)
+#define ml_debug(fmt_p, ...) ML_LOG_PRINT(ML_LOG_DEBUG, fmt_p, ##__VA_ARGS__)
 
 #define membersof(array) (sizeof(array) / sizeof((array)[0]))
 
@@ -97,6 +153,16 @@ typedef int (*ml_shell_command_callback_t)(int argc,
 
 typedef void (*ml_worker_pool_job_entry_t)(void *arg_p);
 
+typedef void *(*ml_worker_pool_future_entry_t)(void *arg_p);
+
+typedef void (*ml_parallel_for_entry_t)(size_t begin,
+                                        size_t end,
+                                        void *arg_p);
+
+typedef uint64_t (*ml_parallel_map_t)(size_t begin, size_t end, void *arg_p);
+
+typedef uint64_t (*ml_parallel_reduce_t)(uint64_t left, uint64_t right);
+
 typedef void (*ml_message_on_free_t)(void *message_p);
 
 struct ml_uid_t {
@@ -105,40 +171,143 @@ struct ml_uid_t {
 
 struct ml_message_header_t {
     struct ml_uid_t *uid_p;
-    int count;
+    atomic_int count;
+    int size_class;
     ml_message_on_free_t on_free;
 };
 
 typedef void (*ml_queue_put_t)(void *arg_p);
 
+struct ml_queue_cell_t {
+    atomic_uint sequence;
+    struct ml_message_header_t *_Atomic header_p;
+    /* Id of the message, readable without dereferencing it. */
+    struct ml_uid_t *_Atomic uid_p;
+};
+
+/* Threads sleeping on a futex until signalled. */
+struct ml_waiters_t {
+    atomic_uint sequence;
+    atomic_int count;
+};
+
+/* A bounded lock-free ring buffer of cells. Each cell starts with an
+   atomic_uint sequence number. */
+struct ml_ring_t {
+    unsigned int mask;
+    size_t cell_size;
+    char *cells_p;
+    char padding_1[ML_CACHE_LINE_SIZE];
+    atomic_uint wrpos;
+    char padding_2[ML_CACHE_LINE_SIZE];
+    atomic_uint rdpos;
+    char padding_3[ML_CACHE_LINE_SIZE];
+};
+
 struct ml_queue_t {
     struct {
         ml_queue_put_t func;
         void *arg_p;
     } on_put;
-    volatile int rdpos;
-    volatile int wrpos;
-    int length;
-    struct ml_message_header_t **messages_p;
-    pthread_mutex_t mutex;
-    pthread_cond_t full_cond;
-    pthread_cond_t empty_cond;
+    struct ml_ring_t ring;
+    struct ml_waiters_t full;
+    struct ml_waiters_t empty;
+    struct {
+        atomic_int fd;
+        atomic_bool is_signalled;
+    } poll;
+};
+
+enum ml_bus_overflow_policy_t {
+    ml_bus_overflow_policy_block_t = 0,
+    ml_bus_overflow_policy_drop_newest_t,
+    ml_bus_overflow_policy_drop_oldest_t,
+    ml_bus_overflow_policy_coalesce_t
 };
 
 struct ml_bus_elem_t {
     struct ml_uid_t *uid_p;
-    int number_of_queues;
-    struct ml_queue_t **queues_pp;
+    int number_of_subscribers;
+    struct ml_bus_subscriber_t **subscribers_pp;
 };
 
 struct ml_bus_t {
+    pthread_mutex_t mutex;
     int number_of_elems;
     struct ml_bus_elem_t *elems_p;
+    struct ml_bus_table_t *_Atomic table_p;
+    struct ml_bus_table_t *retired_p;
+    char padding[ML_CACHE_LINE_SIZE];
+    struct {
+        atomic_uint epoch;
+        atomic_int counts[2];
+    } readers;
+};
+
+struct ml_worker_pool_slot_t {
+    atomic_uint sequence;
+    ml_worker_pool_job_entry_t entry;
+    void *arg_p;
+    uint64_t spawn_time;
+};
+
+struct ml_worker_pool_lane_t {
+    struct ml_ring_t ring;
+    int weight;
+    struct ml_waiters_t full;
+    struct {
+        atomic_ullong number_of_jobs;
+        atomic_ullong total_wait_time;
+        atomic_ullong max_wait_time;
+    } statistics;
+};
+
+struct ml_worker_pool_lane_statistics_t {
+    /* Number of jobs waiting in the lane. Lane zero(0) includes jobs in
+       worker deques and in the overflow list. */
+    unsigned int depth;
+    /* Number of jobs taken from the lane, spawned while statistics
+       were enabled. */
+    unsigned long long number_of_jobs;
+    /* Time from spawn until a worker took the job, in nanoseconds. */
+    unsigned long long total_wait_time;
+    unsigned long long max_wait_time;
+};
+
+/* A job allocated by the caller, often embedded in a larger struct. */
+struct ml_worker_pool_job_t {
+    ml_worker_pool_job_entry_t entry;
+    void *arg_p;
+    uint64_t spawn_time;
+    struct ml_worker_pool_job_t *next_p;
+};
+
+struct ml_worker_pool_future_t {
+    struct ml_worker_pool_job_t job;
+    struct ml_worker_pool_t *pool_p;
+    ml_worker_pool_future_entry_t entry;
+    void *arg_p;
+    void *result_p;
+    atomic_uint state;
+    struct ml_worker_pool_future_t *_Atomic next_p;
 };
 
 struct ml_worker_pool_t {
-    pthread_t pthread;
-    struct ml_queue_t jobs;
+    /* Maximum number of workers. */
+    int number_of_workers;
+    pthread_t *pthreads_p;
+    struct ml_worker_pool_worker_t *workers_p;
+    int number_of_lanes;
+    struct ml_worker_pool_lane_t *lanes_p;
+    bool is_weighted;
+    struct ml_worker_pool_job_t *_Atomic overflow_p;
+    atomic_int number_of_overflow_jobs;
+    atomic_bool is_lane_statistics_enabled;
+    struct ml_waiters_t idle;
+    int minimum_number_of_workers;
+    int idle_timeout;
+    pthread_mutex_t mutex;
+    atomic_int number_of_running_workers;
 };
 
 struct ml_log_object_t {
@@ -190,27 +359,65 @@ struct ml_dhcp_client_t {
     struct ml_log_object_t log_object;
 };
 
+/* Expiry token embedded in a timer. */
+struct ml_timer_expiry_t {
+    struct ml_timer_t *timer_p;
+    /* Timer generation when expired, shifted left one bit, with the
+       lowest bit set while the token is in the queue. */
+    atomic_uint state;
+};
+
 struct ml_timer_t {
     struct ml_timer_handler_t *handler_p;
     unsigned int initial_ticks;
     unsigned int repeat_ticks;
-    unsigned int delta;
+    uint64_t expiry_tick;
     struct ml_uid_t *message_p;
     struct ml_queue_t *queue_p;
     int number_of_outstanding_timeouts;
     int number_of_timeouts_to_ignore;
     struct ml_timer_t *next_p;
+    /* Points to the pointer to this timer, or NULL if not active. */
+    struct ml_timer_t **prev_pp;
+    /* Expiries not yet put on the queue, as it was full. */
+    struct {
+        int count;
+        struct ml_timer_t *next_p;
+        /* Points to the pointer to this timer, or NULL if none. */
+        struct ml_timer_t **prev_pp;
+    } pending;
+    bool is_embedded;
+    /* Incremented when stopped. */
+    atomic_uint generation;
+    struct {
+        struct ml_message_header_t header;
+        struct ml_timer_expiry_t expiry;
+    } token;
 };
 
-struct ml_timer_list_t {
-    struct ml_timer_t *head_p;  /* List of timers sorted by expiry
-                                   time. */
-    struct ml_timer_t tail;     /* Tail element of list. */
+struct ml_timer_wheel_t {
+    /* Next tick to process. */
+    uint64_t tick;
+    struct ml_timer_t *slots[ML_TIMER_WHEEL_LEVELS][ML_TIMER_WHEEL_SLOTS];
 };
 
 struct ml_timer_handler_t {
     int fd;
-    struct ml_timer_list_t timers;
+    struct ml_timer_wheel_t wheel;
+    clockid_t clock_id;
+    /* Time of tick zero(0), in nanoseconds. */
+    uint64_t start_time;
+    /* Tick the file descriptor expires at. */
+    uint64_t armed_tick;
+    /* Clock jump notifications, if not NULL. */
+    struct ml_bus_t *bus_p;
+    int clock_jump_fd;
+    /* Timers with expiries not yet put on their queues, oldest
+       first. */
+    struct {
+        struct ml_timer_t *head_p;
+        struct ml_timer_t **tail_pp;
+    } pending;
     pthread_t pthread;
     pthread_mutex_t mutex;
 };
@@ -247,6 +454,10 @@ struct ml_one_wire_read_temperature_rsp_t {
 extern struct ml_uid_t ml_one_wire_read_temperature_req;
 extern struct ml_uid_t ml_one_wire_read_temperature_rsp;
 
+/* Broadcasted by a timer handler when the realtime clock is set, for
+   example by the NTP client. The message has no payload. */
+extern struct ml_uid_t ml_timer_clock_jump;
+
 /**
  * Initialize the Monolinux module. This must be called before any
  * other function in this module.
@@ -273,6 +484,10 @@ void ml_broadcast(void *message_p);
  */
 void ml_spawn(ml_worker_pool_job_entry_t entry, void *arg_p);
 
+/* The default log object, used by ml_info() and friends. Its level
+   is checked inline before any arguments are evaluated. */
+extern struct ml_log_object_t ml_log_default_object;
+
 /**
  * Logging using the default log object.
  */
@@ -283,10 +498,12 @@ void ml_log_set_level(int level);
 bool ml_log_is_enabled_for(int level);
 
 /**
- * Initialize given timer in the default timer handler. Puts a message
- * with given id on given queue on expiry. Call
- * `ml_timer_is_message_valid()` to check if a received expiry message
- * should be discarded.
+ * Initialize given timer in the default timer handler of the calling
+ * thread. There are as many default handlers as CPUs, but they are
+ * shards per thread, not per CPU, as threads are assigned handlers
+ * round robin. Puts a message with given id on given queue on
+ * expiry. Call `ml_timer_is_message_valid()` to check if a received
+ * expiry message should be discarded.
  */
 void ml_timer_init(struct ml_timer_t *self_p,
                    struct ml_uid_t *message_p,
@@ -294,7 +511,8 @@ void ml_timer_init(struct ml_timer_t *self_p,
 
 /**
  * (Re)start given timer in the default timer handler. Both `initial`
- * and `repeat` are in milliseconds.
+ * and `repeat` are in milliseconds, which is also the timer
+ * resolution. A timer never expires early.
  */
 void ml_timer_start(struct ml_timer_t *self_p,
                     unsigned int initial,
@@ -315,7 +533,29 @@ void ml_timer_stop(struct ml_timer_t *self_p);
 bool ml_timer_is_message_valid(struct ml_timer_t *self_p);
 
 /**
- * Allocate a message with given id and size. The size may be zero.
+ * As ml_timer_init(), but puts an expiry token embedded in given timer
+ * on given queue instead of allocating a message, so expiries never
+ * allocate memory. Expiries are coalesced while the token is in the
+ * queue. Call `ml_timer_take_expiry()` instead of
+ * `ml_timer_is_message_valid()` for each received token.
+ */
+void ml_timer_init_embedded(struct ml_timer_t *self_p,
+                            struct ml_uid_t *message_p,
+                            struct ml_queue_t *queue_p);
+
+/**
+ * Take given received expiry token, so that the timer can put it on
+ * its queue again. Returns true if the expiry is valid, or false if
+ * the timer has been stopped or restarted since it expired. Never
+ * takes the timer handler mutex. Freeing the token is optional, and
+ * does nothing.
+ */
+bool ml_timer_take_expiry(void *message_p);
+
+/**
+ * Allocate a message with given id and size. The size may be
+ * zero. Small messages are allocated from per-thread caches of fixed
+ * size classes, and only large messages use malloc().
  */
 void *ml_message_alloc(struct ml_uid_t *uid_p, size_t size);
 
@@ -331,14 +571,24 @@ void ml_message_set_on_free(void *message_p, ml_message_on_free_t on_free);
 void ml_message_free(void *message_p);
 
 /**
- * Initialize given message queue. Only one thread may get messages
- * from a queue. Multiple threads may put messages on a queue.
+ * Share given message count times. Count must not be negative. The
+ * message is freed once ml_message_free() has been called count + 1
+ * times. Sharing and freeing are lock-free.
+ */
+void ml_message_share(void *message_p, int count);
+
+/**
+ * Initialize given message queue. The queue is a lock-free ring
+ * buffer, and its capacity is `length` rounded up to the nearest
+ * power of two (minimum two). Multiple threads may put messages on a
+ * queue, and one (or more) threads may get messages from it. Threads
+ * only sleep when the queue is empty or full.
  */
 void ml_queue_init(struct ml_queue_t *self_p, int length);
 
 /**
  * Destroy given queue. The queue may not be used after this function
- * has been called.
+ * has been called. Closes the file descriptor, if any.
  */
 void ml_queue_destroy(struct ml_queue_t *self_p);
 
@@ -350,6 +600,16 @@ void ml_queue_set_on_put(struct ml_queue_t *self_p,
                          ml_queue_put_t func,
                          void *arg_p);
 
+/**
+ * Get a file descriptor that is readable when given queue is not
+ * empty, for use with poll(), select() and epoll. Get messages with
+ * ml_queue_try_get() until it returns NULL when the file descriptor
+ * is readable. Never read from or write to the file descriptor. The
+ * file descriptor is created on the first call, and queues that are
+ * never polled have no file descriptor. Returns -1 on failure.
+ */
+int ml_queue_get_fd(struct ml_queue_t *self_p);
+
 /**
  * Get the oldest message from given message queue. It is forbidden to
  * modify the message as it may be shared between multiple
@@ -357,24 +617,119 @@ void ml_queue_set_on_put(struct ml_queue_t *self_p,
  */
 struct ml_uid_t *ml_queue_get(struct ml_queue_t *self_p, void **message_pp);
 
+/**
+ * As ml_queue_get(), but returns NULL immediately if given queue is
+ * empty.
+ */
+struct ml_uid_t *ml_queue_try_get(struct ml_queue_t *self_p,
+                                  void **message_pp);
+
+/**
+ * As ml_queue_get(), but waits at most given timeout in milliseconds
+ * for a message. Returns NULL on timeout.
+ */
+struct ml_uid_t *ml_queue_get_timeout(struct ml_queue_t *self_p,
+                                      void **message_pp,
+                                      int timeout);
+
+/**
+ * Get up to given number of messages from given queue. Waits at most
+ * given timeout in milliseconds for at least one message. A negative
+ * timeout waits forever. Returns the number of messages written to
+ * `uids_pp` and `messages_pp`, or zero on timeout. Free the messages
+ * once used.
+ */
+int ml_queue_get_many(struct ml_queue_t *self_p,
+                      struct ml_uid_t **uids_pp,
+                      void **messages_pp,
+                      int length,
+                      int timeout);
+
 /**
  * Put given message into given queue.
  */
 void ml_queue_put(struct ml_queue_t *self_p, void *message_p);
 
+/**
+ * As ml_queue_put(), but returns -EAGAIN immediately if given queue
+ * is full. The caller still owns the message on failure. Returns zero
+ * on success.
+ */
+int ml_queue_try_put(struct ml_queue_t *self_p, void *message_p);
+
+/**
+ * As ml_queue_put(), but waits at most given timeout in milliseconds
+ * for room in given queue. Returns -ETIMEDOUT on timeout, in which
+ * case the caller still owns the message. Returns zero on success.
+ */
+int ml_queue_put_timeout(struct ml_queue_t *self_p,
+                         void *message_p,
+                         int timeout);
+
+/**
+ * Put given messages into given queue, in order. Consumers are woken
+ * up once per batch of messages instead of once per message.
+ */
+void ml_queue_put_many(struct ml_queue_t *self_p,
+                       void **messages_pp,
+                       int length);
+
 /**
  * Initialize given bus.
  */
 void ml_bus_init(struct ml_bus_t *self_p);
 
 /**
- * Subscribe to given message. This function must only be called
- * before any message is broadcasted on given bus.
+ * Subscribe to given message. May be called at any time, also while
+ * other threads are broadcasting on given bus.
  */
 void ml_bus_subscribe(struct ml_bus_t *self_p,
                       struct ml_queue_t *queue_p,
                       struct ml_uid_t *uid_p);
 
+/**
+ * Subscribe to given message with given overflow policy, telling what
+ * to do when given queue is full:
+ *
+ * - ml_bus_overflow_policy_block_t: Wait for space in the queue, as
+ *   ml_bus_subscribe().
+ *
+ * - ml_bus_overflow_policy_drop_newest_t: Drop the broadcasted
+ *   message.
+ *
+ * - ml_bus_overflow_policy_drop_oldest_t: Drop the oldest message in
+ *   the queue if it has given id, until the broadcasted message
+ *   fits. Messages put by other subscriptions or other producers are
+ *   never dropped, so the broadcasted message is dropped instead if
+ *   the oldest message has another id.
+ *
+ * - ml_bus_overflow_policy_coalesce_t: Replace the previously
+ *   broadcasted message with given id if it is still in the queue,
+ *   otherwise drop the broadcasted message if the queue is full. The
+ *   queue holds at most one message with given id. The subscription
+ *   keeps a reference to the last broadcasted message until it is
+ *   replaced by the next one, or until unsubscribed, so the message
+ *   is not freed, and its on_free callback is not called, until then.
+ *
+ * Only the blocking policy ever makes the broadcaster wait for the
+ * consumer.
+ */
+void ml_bus_subscribe_with_policy(struct ml_bus_t *self_p,
+                                  struct ml_queue_t *queue_p,
+                                  struct ml_uid_t *uid_p,
+                                  enum ml_bus_overflow_policy_t policy);
+
+/**
+ * Unsubscribe from given message. Broadcasts that started before
+ * this function returned may still put messages on given queue, but
+ * later broadcasts will not. Never waits for broadcasts in
+ * progress. Returns zero(0) if successful, or -ENOENT if given queue
+ * did not subscribe to given message.
+ */
+int ml_bus_unsubscribe(struct ml_bus_t *self_p,
+                       struct ml_queue_t *queue_p,
+                       struct ml_uid_t *uid_p);
+
 /**
  * Broadcast given message on given bus. All subscribers will receive
  * the message.
@@ -382,24 +737,241 @@ void ml_bus_subscribe(struct ml_bus_t *self_p,
 void ml_bus_broadcast(struct ml_bus_t *self_p, void *message_p);
 
 /**
- * Initialize a worker pool.
+ * Returns the number of messages dropped or replaced by the overflow
+ * policy of given subscription, or -ENOENT if given queue did not
+ * subscribe to given message.
+ */
+long long ml_bus_get_number_of_drops(struct ml_bus_t *self_p,
+                                     struct ml_queue_t *queue_p,
+                                     struct ml_uid_t *uid_p);
+
+/**
+ * Initialize a worker pool with given number of worker threads. Jobs
+ * spawned from outside the pool are put in a shared queue of given
+ * length. The worker thread handles are available in the pthreads_p
+ * array. In an elastic pool, pthreads_p[i] is the last thread started
+ * for worker i, which may have exited if the worker retired. It is
+ * joined by the pool when the worker is started again, and must
+ * never be joined or detached by the user.
  */
 void ml_worker_pool_init(struct ml_worker_pool_t *self_p,
                          int number_of_workers,
                          int job_queue_length);
 
 /**
- * Spawn a job in given worker pool.
+ * Initialize a worker pool with given number of priority lanes, each
+ * with a shared queue of given length. Lane zero(0) has the highest
+ * priority. If given weights are NULL, workers always take jobs from
+ * the highest priority non-empty lane. Otherwise workers take up to
+ * weights_p[lane] jobs from each lane in turn, so low priority lanes
+ * are never starved.
+ */
+void ml_worker_pool_init_lanes(struct ml_worker_pool_t *self_p,
+                               int number_of_workers,
+                               int job_queue_length,
+                               int number_of_lanes,
+                               const int *weights_p);
+
+/**
+ * Initialize an elastic worker pool, starting with one worker per
+ * online CPU, but at least minimum and at most maximum number of
+ * workers. A worker is added when a job is put in a shared queue, or a
+ * worker waits for a future, while no worker is idle. Workers above
+ * minimum exit after being idle for given timeout in milliseconds. If
+ * cpus_p is not NULL, worker i is pinned to CPU cpus_p[i], unless
+ * negative.
+ */
+void ml_worker_pool_init_elastic(struct ml_worker_pool_t *self_p,
+                                 int minimum_number_of_workers,
+                                 int maximum_number_of_workers,
+                                 int idle_timeout,
+                                 int job_queue_length,
+                                 const int *cpus_p);
+
+/**
+ * Returns the number of running workers in given worker pool.
+ */
+int ml_worker_pool_get_number_of_workers(struct ml_worker_pool_t *self_p);
+
+/**
+ * Spawn a job in lane zero(0) of given worker pool. Jobs spawned by a
+ * worker are first put in its own deque, and may be stolen by idle
+ * workers. Jobs spawned by other threads wait if the lane's shared
+ * queue is full. Never allocates memory.
  */
 void ml_worker_pool_spawn(struct ml_worker_pool_t *self_p,
                           ml_worker_pool_job_entry_t entry,
                           void *arg_p);
 
+/**
+ * Spawn a job in given lane of given worker pool. Jobs in other lanes
+ * than zero(0) are always put in the lane's shared queue, also when
+ * spawned by a worker.
+ */
+void ml_worker_pool_spawn_lane(struct ml_worker_pool_t *self_p,
+                               int lane,
+                               ml_worker_pool_job_entry_t entry,
+                               void *arg_p);
+
+/**
+ * Enable or disable lane statistics in given worker pool. Disabled by
+ * default, as it reads the clock twice per job.
+ */
+void ml_worker_pool_set_lane_statistics(struct ml_worker_pool_t *self_p,
+                                        bool enabled);
+
+/**
+ * Get statistics of given lane. Wait times and number of jobs are
+ * only collected for jobs spawned with statistics enabled.
+ */
+void ml_worker_pool_get_lane_statistics(
+    struct ml_worker_pool_t *self_p,
+    int lane,
+    struct ml_worker_pool_lane_statistics_t *statistics_p);
+
+/**
+ * Initialize given caller allocated job.
+ */
+void ml_worker_pool_job_init(struct ml_worker_pool_job_t *self_p,
+                             ml_worker_pool_job_entry_t entry,
+                             void *arg_p);
+
+/**
+ * Spawn given caller allocated job in given worker pool. As
+ * ml_worker_pool_spawn(), but never waits, as the job is linked into
+ * an overflow list if the shared queue of lane zero(0) is full. The
+ * job must not be modified until its entry function is called, and
+ * may be spawned again after that.
+ */
+void ml_worker_pool_spawn_job(struct ml_worker_pool_t *self_p,
+                              struct ml_worker_pool_job_t *job_p);
+
+/**
+ * Run given entry function with given argument in given worker pool,
+ * and store its result in given caller allocated future. The future
+ * must not be modified until it is done, and may be reused after
+ * that. Never waits.
+ */
+void ml_worker_pool_submit(struct ml_worker_pool_t *self_p,
+                           struct ml_worker_pool_future_t *future_p,
+                           ml_worker_pool_future_entry_t entry,
+                           void *arg_p);
+
+/**
+ * Wait for given future to be done and return its result. Workers in
+ * the future's pool run other jobs while waiting.
+ */
+void *ml_worker_pool_future_wait(struct ml_worker_pool_future_t *self_p);
+
+/**
+ * As ml_worker_pool_future_wait(), but waits at most given timeout
+ * in milliseconds. Returns zero(0) and the result in given result
+ * pointer if done, or -ETIMEDOUT on timeout.
+ */
+int ml_worker_pool_future_wait_timeout(struct ml_worker_pool_future_t *self_p,
+                                       int timeout,
+                                       void **result_pp);
+
+/**
+ * Run given entry function in the same worker pool with the result of
+ * given future as argument once it is done. The result is stored in
+ * given next future, which can be waited for and chained as any
+ * other future. At most one continuation can be added to a
+ * future. Returns zero(0) on success, or -EBUSY if given future
+ * already has a continuation, in which case given next future is not
+ * run.
+ */
+int ml_worker_pool_future_then(struct ml_worker_pool_future_t *self_p,
+                               struct ml_worker_pool_future_t *next_p,
+                               ml_worker_pool_future_entry_t entry);
+
+/**
+ * Wait for all given futures to be done.
+ */
+void ml_worker_pool_wait_all(struct ml_worker_pool_future_t *futures_p,
+                             int length);
+
+/**
+ * Call given entry function for chunks of the range [begin, end)
+ * until the whole range is done, in parallel in the calling thread
+ * and in workers of given pool. Chunks are never smaller than given
+ * grain size, except the last one, and get smaller as the remaining
+ * range shrinks. Returns when all chunks are done.
+ */
+void ml_parallel_for(struct ml_worker_pool_t *pool_p,
+                     size_t begin,
+                     size_t end,
+                     size_t grain,
+                     ml_parallel_for_entry_t entry,
+                     void *arg_p);
+
+/**
+ * As ml_parallel_for(), but given map function returns a value for
+ * each chunk, and all values are combined with given reduce function,
+ * starting from given identity value. The reduce function must be
+ * associative and commutative, as chunks are combined in any
+ * order. Returns the combined value.
+ */
+uint64_t ml_parallel_reduce(struct ml_worker_pool_t *pool_p,
+                            size_t begin,
+                            size_t end,
+                            size_t grain,
+                            uint64_t identity,
+                            ml_parallel_map_t map,
+                            ml_parallel_reduce_t reduce,
+                            void *arg_p);
+
 /**
  * Initialize the log object module.
  */
 void ml_log_object_module_init(const char *log_object_path_p);
 
+/**
+ * Include milliseconds in the timestamp of log entries, as in
+ * "2020-01-01 12:00:00.123". Entries printed in the calling thread
+ * use a coarse clock, which is cheap to read but typically only has
+ * a few milliseconds resolution. Disabled by default.
+ */
+void ml_log_object_module_set_milliseconds(bool enabled);
+
+/**
+ * Start a background thread that writes all log entries. Logging
+ * threads then only format the message of an entry into a per-thread
+ * ring buffer, which is cheap and never makes a system call, unless
+ * the buffer is full. Entries are written some time later, and the
+ * ones still buffered are lost if the process crashes.
+ */
+void ml_log_object_module_start_writer(void);
+
+/**
+ * Wait until all log entries printed before this call have been
+ * written. Does nothing if the writer thread is not started.
+ */
+void ml_log_object_flush(void);
+
+/**
+ * Record log entries in binary form in a circular buffer of given
+ * size in bytes instead of writing them. The format string address,
+ * a timestamp and the arguments of each entry are stored, and the
+ * entry is formatted only when rendered, which is much cheaper than
+ * formatting it when printed. Format strings must be string literals
+ * or otherwise live as long as the process. The oldest entries are
+ * overwritten when the buffer is full.
+ */
+void ml_log_object_module_start_binary(size_t size);
+
+/**
+ * Format all entries in the binary buffer, oldest first.
+ */
+void ml_log_object_binary_render(FILE *fout_p);
+
+/**
+ * Write the binary buffer to given file. Decode it on the host with
+ * 'ml decode_log <executable> <file>'. Returns zero(0) or negative
+ * error code.
+ */
+int ml_log_object_binary_dump(const char *path_p);
+
 /**
  * Load log object state from disk. Loads log levels.
  */
@@ -735,13 +1307,32 @@ uint16_t ml_inet_checksum_end(uint32_t acc);
 
 uint16_t ml_inet_checksum(const void *buf_p, size_t size);
 
+/**
+ * Initialize given timer handler on CLOCK_MONOTONIC.
+ */
 void ml_timer_handler_init(struct ml_timer_handler_t *self_p);
 
+/**
+ * Initialize given timer handler on given clock, CLOCK_MONOTONIC or
+ * CLOCK_BOOTTIME. Timers on CLOCK_BOOTTIME keep counting while the
+ * system is suspended. If given bus is not NULL, a
+ * `ml_timer_clock_jump` message is broadcasted on it whenever the
+ * realtime clock is set.
+ */
+void ml_timer_handler_init_clock(struct ml_timer_handler_t *self_p,
+                                 clockid_t clock_id,
+                                 struct ml_bus_t *bus_p);
+
 void ml_timer_handler_timer_init(struct ml_timer_handler_t *self_p,
                                  struct ml_timer_t *timer_p,
                                  struct ml_uid_t *message_p,
                                  struct ml_queue_t *queue_p);
 
+void ml_timer_handler_timer_init_embedded(struct ml_timer_handler_t *self_p,
+                                          struct ml_timer_t *timer_p,
+                                          struct ml_uid_t *message_p,
+                                          struct ml_queue_t *queue_p);
+
 void ml_timer_handler_timer_start(struct ml_timer_t *timer_p,
                                   unsigned int initial,
                                   unsigned int repeat);
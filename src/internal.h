@@ -43,14 +43,156 @@ static inline void *message_from_header(struct ml_message_header_t *header_p)
 }
 
 /**
- * Initialize the message submodule. Normally only called by
- * ml_init().
+ * Initialize given message header embedded in another object.
+ * ml_message_free() does nothing for such messages.
  */
-void ml_message_init(void);
+void ml_message_init_embedded(struct ml_message_header_t *header_p,
+                              struct ml_uid_t *uid_p);
 
 /**
- * Share given message count times. Count must not be negative.
+ * As ml_queue_try_put(), but also returns the position of the message
+ * in the queue, for ml_queue_try_replace().
  */
-void ml_message_share(void *message_p, int count);
+int ml_queue_try_put_position(struct ml_queue_t *self_p,
+                              void *message_p,
+                              unsigned int *position_p);
+
+/**
+ * Get the oldest message in given queue if it has given id. Never
+ * waits. Returns true if a message was taken.
+ */
+bool ml_queue_try_get_if(struct ml_queue_t *self_p,
+                         struct ml_uid_t *uid_p,
+                         void **message_pp);
+
+/**
+ * Replace given message at given position with given new message,
+ * unless it has already been taken by a consumer. The caller must
+ * hold a reference to the old message, so that it is not reused while
+ * replacing. Returns true if replaced.
+ */
+bool ml_queue_try_replace(struct ml_queue_t *self_p,
+                          unsigned int position,
+                          void *old_message_p,
+                          void *new_message_p);
+
+/**
+ * Sleep until woken up if given futex still has given value. Given
+ * deadline is an absolute CLOCK_MONOTONIC time, or NULL to wait
+ * forever.
+ */
+int ml_futex_wait(atomic_uint *futex_p,
+                  unsigned int value,
+                  const struct timespec *deadline_p);
+
+/**
+ * Wake up to given number of threads waiting on given futex.
+ */
+int ml_futex_wake(atomic_uint *futex_p, int count);
+
+/**
+ * Calculate the absolute CLOCK_MONOTONIC deadline of given timeout in
+ * milliseconds.
+ */
+struct timespec *ml_make_deadline(struct timespec *deadline_p, int timeout);
+
+/*
+ * An eventcount for sleeping until a condition becomes true. The
+ * waiter calls ml_waiters_enter(), checks the condition again, and
+ * calls ml_waiters_wait() only if it is still false, followed by
+ * ml_waiters_leave(). The signaler makes the condition true before
+ * calling ml_waiters_signal().
+ */
+
+void ml_waiters_init(struct ml_waiters_t *self_p);
+
+/**
+ * Register as waiter and return the sequence number to wait for.
+ */
+unsigned int ml_waiters_enter(struct ml_waiters_t *self_p);
+
+/**
+ * Returns -ETIMEDOUT if given deadline was reached, otherwise zero.
+ */
+int ml_waiters_wait(struct ml_waiters_t *self_p,
+                    unsigned int sequence,
+                    const struct timespec *deadline_p);
+
+void ml_waiters_leave(struct ml_waiters_t *self_p);
+
+/**
+ * Wake up given number of waiters, if any. Cheap if there are no
+ * waiters.
+ */
+void ml_waiters_signal(struct ml_waiters_t *self_p, int count);
+
+/*
+ * A bounded lock-free ring buffer based on Dmitry Vyukov's MPMC
+ * queue. Each cell has a sequence number telling if it is ready to be
+ * written to or read from. A producer claims free cells, fills them
+ * and publishes them one by one. A consumer claims filled cells,
+ * empties them and releases them one by one.
+ */
+
+/**
+ * Initialize given ring with at least given number of cells of given
+ * size. The first member of a cell must be an atomic_uint.
+ */
+void ml_ring_init(struct ml_ring_t *self_p, int length, size_t cell_size);
+
+void ml_ring_destroy(struct ml_ring_t *self_p);
+
+static inline void *ml_ring_cell(struct ml_ring_t *self_p, unsigned int pos)
+{
+    return (&self_p->cells_p[(pos & self_p->mask) * self_p->cell_size]);
+}
+
+/**
+ * Claim up to given number of consecutive free cells with one
+ * compare-and-swap. Returns the number of claimed cells, and the
+ * position of the first one in given position pointer.
+ */
+int ml_ring_try_claim_write(struct ml_ring_t *self_p,
+                            int length,
+                            unsigned int *pos_p);
+
+/**
+ * Make the filled cell at given position readable.
+ */
+void ml_ring_publish(struct ml_ring_t *self_p, unsigned int pos);
+
+/**
+ * Claim up to given number of consecutive readable cells with one
+ * compare-and-swap. Returns the number of claimed cells, and the
+ * position of the first one in given position pointer.
+ */
+int ml_ring_try_claim_read(struct ml_ring_t *self_p,
+                           int length,
+                           unsigned int *pos_p);
+
+/**
+ * Returns true if the oldest cell is readable, and its position in
+ * given position pointer. The cell may be claimed by another consumer
+ * at any time.
+ */
+bool ml_ring_peek(struct ml_ring_t *self_p, unsigned int *pos_p);
+
+/**
+ * Claim the readable cell at given position if it is still the
+ * oldest. Returns true if claimed.
+ */
+bool ml_ring_try_claim_read_at(struct ml_ring_t *self_p, unsigned int pos);
+
+/**
+ * Make the emptied cell at given position writable again.
+ */
+void ml_ring_release(struct ml_ring_t *self_p, unsigned int pos);
+
+bool ml_ring_is_empty(struct ml_ring_t *self_p);
+
+/**
+ * Returns the number of claimed or filled cells.
+ */
+unsigned int ml_ring_get_length(struct ml_ring_t *self_p);
 
 #endif
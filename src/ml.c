@@ -41,6 +41,15 @@
 #include "ml/ml.h"
 #include "internal.h"
 
+/* Default worker pool workers per online CPU, at most. */
+#define WORKER_POOL_WORKERS_PER_CPU                         4
+
+/* Default worker pool idle timeout in milliseconds. */
+#define WORKER_POOL_IDLE_TIMEOUT                            10000
+
+/* Default timer handlers, one per online CPU up to this many. */
+#define MAXIMUM_NUMBER_OF_TIMER_HANDLERS                    8
+
 struct cpu_stats_t {
     unsigned long long user;
     unsigned long long nice;
@@ -55,12 +64,20 @@ struct cpu_stats_t {
 struct module_t {
     struct ml_bus_t bus;
     struct ml_worker_pool_t worker_pool;
-    struct ml_timer_handler_t timer_handler;
-    struct ml_log_object_t log_object;
+    struct {
+        int length;
+        struct ml_timer_handler_t *handlers_p;
+        atomic_uint next;
+    } timer_handlers;
 };
 
 static struct module_t module;
 
+struct ml_log_object_t ml_log_default_object;
+
+/* Timer handler used by timers initialized in this thread. */
+static __thread int timer_handler_index = -1;
+
 static inline bool char_in_string(char c, const char *str_p)
 {
     while (*str_p != '\0') {
@@ -192,15 +209,70 @@ static unsigned calc_cpu_load(unsigned long long old,
     return ((100 * (new - old)) / total_diff);
 }
 
+/**
+ * Timers are spread over as many handlers as there are CPUs, each
+ * with its own thread and mutex. Handlers are shards per thread, not
+ * per CPU, as threads migrate between CPUs. Only the first handler
+ * reports clock jumps.
+ */
+static void timer_handlers_init(void)
+{
+    int i;
+
+    module.timer_handlers.length = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (module.timer_handlers.length > MAXIMUM_NUMBER_OF_TIMER_HANDLERS) {
+        module.timer_handlers.length = MAXIMUM_NUMBER_OF_TIMER_HANDLERS;
+    }
+
+    if (module.timer_handlers.length < 1) {
+        module.timer_handlers.length = 1;
+    }
+
+    module.timer_handlers.handlers_p = xmalloc(
+        sizeof(*module.timer_handlers.handlers_p)
+        * (size_t)module.timer_handlers.length);
+    atomic_init(&module.timer_handlers.next, 0);
+
+    for (i = 0; i < module.timer_handlers.length; i++) {
+        ml_timer_handler_init_clock(&module.timer_handlers.handlers_p[i],
+                                    CLOCK_MONOTONIC,
+                                    i == 0 ? &module.bus : NULL);
+    }
+}
+
+/**
+ * Threads are assigned handlers round robin when initializing their
+ * first timer, so timers owned by different threads rarely share a
+ * handler mutex.
+ */
+static struct ml_timer_handler_t *timer_handler_get(void)
+{
+    if (timer_handler_index == -1) {
+        timer_handler_index = (int)(
+            atomic_fetch_add_explicit(&module.timer_handlers.next,
+                                      1,
+                                      memory_order_relaxed)
+            % (unsigned int)module.timer_handlers.length);
+    }
+
+    return (&module.timer_handlers.handlers_p[timer_handler_index]);
+}
+
 void ml_init(void)
 {
     ml_log_object_module_init(NULL);
-    ml_log_object_init(&module.log_object, "default", ML_LOG_INFO);
-    ml_log_object_register(&module.log_object);
-    ml_message_init();
+    ml_log_object_init(&ml_log_default_object, "default", ML_LOG_INFO);
+    ml_log_object_register(&ml_log_default_object);
     ml_bus_init(&module.bus);
-    ml_worker_pool_init(&module.worker_pool, 4, 32);
-    ml_timer_handler_init(&module.timer_handler);
+    ml_worker_pool_init_elastic(
+        &module.worker_pool,
+        1,
+        WORKER_POOL_WORKERS_PER_CPU * (int)sysconf(_SC_NPROCESSORS_ONLN),
+        WORKER_POOL_IDLE_TIMEOUT,
+        32,
+        NULL);
+    timer_handlers_init();
 }
 
 const char *ml_uid_str(struct ml_uid_t *uid_p)
@@ -528,12 +600,22 @@ void ml_timer_init(struct ml_timer_t *self_p,
                    struct ml_uid_t *message_p,
                    struct ml_queue_t *queue_p)
 {
-    ml_timer_handler_timer_init(&module.timer_handler,
+    ml_timer_handler_timer_init(timer_handler_get(),
                                 self_p,
                                 message_p,
                                 queue_p);
 }
 
+void ml_timer_init_embedded(struct ml_timer_t *self_p,
+                            struct ml_uid_t *message_p,
+                            struct ml_queue_t *queue_p)
+{
+    ml_timer_handler_timer_init_embedded(timer_handler_get(),
+                                         self_p,
+                                         message_p,
+                                         queue_p);
+}
+
 void ml_timer_start(struct ml_timer_t *self_p,
                     unsigned int initial,
 unsigned int repeat)
@@ -551,18 +633,18 @@ void ml_log_print(int level, const char *fmt_p, ...)
     va_list vlist;
 
     va_start(vlist, fmt_p);
-    ml_log_object_vprint(&module.log_object, level, fmt_p, vlist);
+    ml_log_object_vprint(&ml_log_default_object, level, fmt_p, vlist);
     va_end(vlist);
 }
 
 void ml_log_set_level(int level)
 {
-    ml_log_object_set_level(&module.log_object, level);
+    ml_log_object_set_level(&ml_log_default_object, level);
 }
 
 bool ml_log_is_enabled_for(int level)
 {
-    return (ml_log_object_is_enabled_for(&module.log_object, level));
+    return (ml_log_object_is_enabled_for(&ml_log_default_object, level));
 }
 
 int ml_file_write_string(const char *path_p, const char *data_p)
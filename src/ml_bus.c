@@ -26,45 +26,214 @@
  * This file is part of the Monolinux C library project.
  */
 
+/*
+ * Subscriptions are kept in a list of elements, one per message
+ * id. A dispatch table is built from the list on every subscribe and
+ * unsubscribe. The table is an open addressing hash table keyed by
+ * message id address with the subscribers of all ids stored in one
+ * array right after the slots, so a broadcast normally needs one
+ * slot load.
+ *
+ * Tables are never modified once published. Broadcasters announce
+ * themselves in one of two reader counters, selected by the epoch
+ * parity, before loading the table. Replaced tables are retired with
+ * the epoch at the time of replacement. The epoch is only advanced
+ * when no broadcaster is left in the counter of the previous epoch,
+ * so a retired table can no longer be used once the epoch has
+ * advanced twice. Retired tables, and subscribers removed from them,
+ * are freed by later subscribes and unsubscribes, and they never wait
+ * for broadcasters, which may be blocked on full queues.
+ */
+
+#include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "ml/ml.h"
 #include "internal.h"
 
-static int compare_bsearch(const void *key_p, const void *elem_p)
+struct ml_bus_subscriber_t {
+    struct ml_queue_t *queue_p;
+    struct ml_uid_t *uid_p;
+    enum ml_bus_overflow_policy_t policy;
+    atomic_ullong number_of_drops;
+    /* Last message put on the queue by the coalesce policy. */
+    struct {
+        pthread_mutex_t mutex;
+        void *message_p;
+        unsigned int position;
+    } pending;
+    struct ml_bus_subscriber_t *next_p;
+};
+
+struct slot_t {
+    struct ml_uid_t *uid_p;
+    int number_of_subscribers;
+    struct ml_bus_subscriber_t **subscribers_pp;
+};
+
+struct ml_bus_table_t {
+    struct ml_bus_table_t *next_p;
+    unsigned int retired_epoch;
+    struct ml_bus_subscriber_t *unsubscribed_p;
+    unsigned int mask;
+    struct slot_t slots[];
+};
+
+static unsigned int hash(struct ml_uid_t *uid_p)
 {
-    uintptr_t uid;
-    uintptr_t elem_uid;
+    /* Fibonacci hashing. */
+    return ((unsigned int)(((uint64_t)(uintptr_t)uid_p
+                            * 0x9e3779b97f4a7c15ull) >> 32));
+}
 
-    uid = (uintptr_t)(struct ml_uid_t *)key_p;
-    elem_uid = (uintptr_t)((struct ml_bus_elem_t *)elem_p)->uid_p;
+static struct ml_bus_subscriber_t *subscriber_new(
+    struct ml_queue_t *queue_p,
+    struct ml_uid_t *uid_p,
+    enum ml_bus_overflow_policy_t policy)
+{
+    struct ml_bus_subscriber_t *subscriber_p;
 
-    if (uid < elem_uid) {
-        return (-1);
-    } else if (uid == elem_uid) {
-        return (0);
-    } else {
-        return (1);
+    subscriber_p = xmalloc(sizeof(*subscriber_p));
+    subscriber_p->queue_p = queue_p;
+    subscriber_p->uid_p = uid_p;
+    subscriber_p->policy = policy;
+    atomic_init(&subscriber_p->number_of_drops, 0);
+    pthread_mutex_init(&subscriber_p->pending.mutex, NULL);
+    subscriber_p->pending.message_p = NULL;
+    subscriber_p->next_p = NULL;
+
+    return (subscriber_p);
+}
+
+static void subscriber_delete(struct ml_bus_subscriber_t *self_p)
+{
+    if (self_p->pending.message_p != NULL) {
+        ml_message_free(self_p->pending.message_p);
+    }
+
+    pthread_mutex_destroy(&self_p->pending.mutex);
+    free(self_p);
+}
+
+static void subscriber_drop(struct ml_bus_subscriber_t *self_p,
+                            void *message_p)
+{
+    ml_message_free(message_p);
+    atomic_fetch_add_explicit(&self_p->number_of_drops,
+                              1,
+                              memory_order_relaxed);
+}
+
+/**
+ * Only drop messages of this subscription, as other messages in the
+ * queue may be owned by someone else, for example embedded timer
+ * expiry tokens.
+ */
+static void subscriber_put_drop_oldest(struct ml_bus_subscriber_t *self_p,
+                                       void *message_p)
+{
+    void *oldest_p;
+
+    while (ml_queue_try_put(self_p->queue_p, message_p) != 0) {
+        if (!ml_queue_try_get_if(self_p->queue_p,
+                                 self_p->uid_p,
+                                 &oldest_p)) {
+            subscriber_drop(self_p, message_p);
+            break;
+        }
+
+        subscriber_drop(self_p, oldest_p);
     }
 }
 
-static int compare_qsort(const void *lelem_p, const void *relem_p)
+/**
+ * Replace the pending message with given message if not yet taken by
+ * the consumer. The subscriber keeps a reference to the pending
+ * message so it cannot be reused while being replaced.
+ */
+static void subscriber_put_coalesce(struct ml_bus_subscriber_t *self_p,
+                                    void *message_p)
 {
-    uintptr_t luid;
-    uintptr_t ruid;
+    void *pending_p;
 
-    luid = (uintptr_t)((struct ml_bus_elem_t *)lelem_p)->uid_p;
-    ruid = (uintptr_t)((struct ml_bus_elem_t *)relem_p)->uid_p;
+    pthread_mutex_lock(&self_p->pending.mutex);
+    pending_p = self_p->pending.message_p;
+    ml_message_share(message_p, 1);
 
-    if (luid < ruid) {
-        return (-1);
-    } else if (luid == ruid) {
-        return (0);
+    if (pending_p != NULL) {
+        if (ml_queue_try_replace(self_p->queue_p,
+                                 self_p->pending.position,
+                                 pending_p,
+                                 message_p)) {
+            /* The queue's reference. */
+            subscriber_drop(self_p, pending_p);
+            self_p->pending.message_p = message_p;
+        } else if (ml_queue_try_put_position(self_p->queue_p,
+                                             message_p,
+                                             &self_p->pending.position) == 0) {
+            self_p->pending.message_p = message_p;
+        } else {
+            subscriber_drop(self_p, message_p);
+            ml_message_free(message_p);
+            self_p->pending.message_p = NULL;
+        }
+
+        ml_message_free(pending_p);
+    } else if (ml_queue_try_put_position(self_p->queue_p,
+                                         message_p,
+                                         &self_p->pending.position) == 0) {
+        self_p->pending.message_p = message_p;
     } else {
-        return (1);
+        subscriber_drop(self_p, message_p);
+        ml_message_free(message_p);
     }
+
+    pthread_mutex_unlock(&self_p->pending.mutex);
 }
 
-static void insert_element(struct ml_bus_t *self_p, struct ml_uid_t *uid_p)
+static void subscriber_put(struct ml_bus_subscriber_t *self_p,
+                           void *message_p)
+{
+    switch (self_p->policy) {
+
+    case ml_bus_overflow_policy_drop_newest_t:
+        if (ml_queue_try_put(self_p->queue_p, message_p) != 0) {
+            subscriber_drop(self_p, message_p);
+        }
+
+        break;
+
+    case ml_bus_overflow_policy_drop_oldest_t:
+        subscriber_put_drop_oldest(self_p, message_p);
+        break;
+
+    case ml_bus_overflow_policy_coalesce_t:
+        subscriber_put_coalesce(self_p, message_p);
+        break;
+
+    default:
+        ml_queue_put(self_p->queue_p, message_p);
+        break;
+    }
+}
+
+static struct ml_bus_elem_t *find_element(struct ml_bus_t *self_p,
+                                          struct ml_uid_t *uid_p)
+{
+    int i;
+
+    for (i = 0; i < self_p->number_of_elems; i++) {
+        if (self_p->elems_p[i].uid_p == uid_p) {
+            return (&self_p->elems_p[i]);
+        }
+    }
+
+    return (NULL);
+}
+
+static struct ml_bus_elem_t *insert_element(struct ml_bus_t *self_p,
+                                            struct ml_uid_t *uid_p)
 {
     struct ml_bus_elem_t *elem_p;
 
@@ -74,70 +243,328 @@ static void insert_element(struct ml_bus_t *self_p, struct ml_uid_t *uid_p)
         sizeof(*self_p->elems_p) * self_p->number_of_elems);
     elem_p = &self_p->elems_p[self_p->number_of_elems - 1];
     elem_p->uid_p = uid_p;
-    elem_p->number_of_queues = 0;
-    elem_p->queues_pp = xmalloc(1);
-    qsort(self_p->elems_p,
-          self_p->number_of_elems,
-          sizeof(*self_p->elems_p),
-          compare_qsort);
+    elem_p->number_of_subscribers = 0;
+    elem_p->subscribers_pp = xmalloc(1);
+
+    return (elem_p);
 }
 
-static struct ml_bus_elem_t *find_element(struct ml_bus_t *self_p,
-                                          struct ml_uid_t *uid_p)
+static void append_subscriber_to_element(
+    struct ml_bus_elem_t *elem_p,
+    struct ml_bus_subscriber_t *subscriber_p)
 {
-    return (bsearch(uid_p,
-                    self_p->elems_p,
-                    self_p->number_of_elems,
-                    sizeof(*self_p->elems_p),
-                    compare_bsearch));
+    elem_p->number_of_subscribers++;
+    elem_p->subscribers_pp = xrealloc(
+        elem_p->subscribers_pp,
+        sizeof(*elem_p->subscribers_pp) * elem_p->number_of_subscribers);
+    elem_p->subscribers_pp[elem_p->number_of_subscribers - 1] = subscriber_p;
 }
 
-static void append_queue_to_element(struct ml_bus_elem_t *elem_p,
-                                    struct ml_queue_t *queue_p)
+static struct ml_bus_subscriber_t *find_subscriber(
+    struct ml_bus_elem_t *elem_p,
+    struct ml_queue_t *queue_p,
+    int *index_p)
 {
-    elem_p->number_of_queues++;
-    elem_p->queues_pp = xrealloc(
-        elem_p->queues_pp,
-        sizeof(*elem_p->queues_pp) * elem_p->number_of_queues);
-    elem_p->queues_pp[elem_p->number_of_queues - 1] = queue_p;
+    int i;
+
+    for (i = 0; i < elem_p->number_of_subscribers; i++) {
+        if (elem_p->subscribers_pp[i]->queue_p == queue_p) {
+            *index_p = i;
+
+            return (elem_p->subscribers_pp[i]);
+        }
+    }
+
+    return (NULL);
+}
+
+static void remove_subscriber_from_element(struct ml_bus_elem_t *elem_p,
+                                           int index)
+{
+    elem_p->number_of_subscribers--;
+    elem_p->subscribers_pp[index] =
+        elem_p->subscribers_pp[elem_p->number_of_subscribers];
+}
+
+static void remove_element(struct ml_bus_t *self_p,
+                           struct ml_bus_elem_t *elem_p)
+{
+    free(elem_p->subscribers_pp);
+    self_p->number_of_elems--;
+    *elem_p = self_p->elems_p[self_p->number_of_elems];
+}
+
+/**
+ * Build a dispatch table with at most 50% load factor.
+ */
+static struct ml_bus_table_t *build_table(struct ml_bus_t *self_p)
+{
+    struct ml_bus_table_t *table_p;
+    struct ml_bus_elem_t *elem_p;
+    struct ml_bus_subscriber_t **subscribers_pp;
+    struct slot_t *slot_p;
+    unsigned int number_of_slots;
+    unsigned int index;
+    int number_of_subscribers;
+    int i;
+
+    number_of_slots = 2;
+
+    while (number_of_slots < 2 * (unsigned int)self_p->number_of_elems) {
+        number_of_slots *= 2;
+    }
+
+    number_of_subscribers = 0;
+
+    for (i = 0; i < self_p->number_of_elems; i++) {
+        number_of_subscribers += self_p->elems_p[i].number_of_subscribers;
+    }
+
+    table_p = xmalloc(sizeof(*table_p)
+                      + sizeof(table_p->slots[0]) * number_of_slots
+                      + (sizeof(*subscribers_pp)
+                         * (size_t)number_of_subscribers));
+    table_p->unsubscribed_p = NULL;
+    table_p->mask = (number_of_slots - 1);
+    subscribers_pp =
+        (struct ml_bus_subscriber_t **)&table_p->slots[number_of_slots];
+
+    for (index = 0; index < number_of_slots; index++) {
+        table_p->slots[index].uid_p = NULL;
+    }
+
+    for (i = 0; i < self_p->number_of_elems; i++) {
+        elem_p = &self_p->elems_p[i];
+        index = hash(elem_p->uid_p);
+
+        while (true) {
+            slot_p = &table_p->slots[index & table_p->mask];
+
+            if (slot_p->uid_p == NULL) {
+                break;
+            }
+
+            index++;
+        }
+
+        slot_p->uid_p = elem_p->uid_p;
+        slot_p->number_of_subscribers = elem_p->number_of_subscribers;
+        slot_p->subscribers_pp = subscribers_pp;
+        memcpy(subscribers_pp,
+               elem_p->subscribers_pp,
+               (sizeof(*subscribers_pp)
+                * (size_t)elem_p->number_of_subscribers));
+        subscribers_pp += elem_p->number_of_subscribers;
+    }
+
+    return (table_p);
+}
+
+static void table_delete(struct ml_bus_table_t *self_p)
+{
+    if (self_p->unsubscribed_p != NULL) {
+        subscriber_delete(self_p->unsubscribed_p);
+    }
+
+    free(self_p);
+}
+
+static struct slot_t *find_slot(struct ml_bus_table_t *table_p,
+                                struct ml_uid_t *uid_p)
+{
+    struct slot_t *slot_p;
+    unsigned int index;
+
+    index = hash(uid_p);
+
+    while (true) {
+        slot_p = &table_p->slots[index & table_p->mask];
+
+        if (slot_p->uid_p == uid_p) {
+            return (slot_p);
+        } else if (slot_p->uid_p == NULL) {
+            return (NULL);
+        }
+
+        index++;
+    }
+}
+
+/**
+ * Advance the epoch up to two times and free tables that are no
+ * longer used by any broadcaster. Must be called with the mutex
+ * locked.
+ */
+static void reclaim_tables(struct ml_bus_t *self_p)
+{
+    struct ml_bus_table_t **table_pp;
+    struct ml_bus_table_t *table_p;
+    unsigned int epoch;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        epoch = atomic_load(&self_p->readers.epoch);
+
+        if (atomic_load(&self_p->readers.counts[(epoch + 1) & 1]) != 0) {
+            break;
+        }
+
+        atomic_store(&self_p->readers.epoch, epoch + 1);
+    }
+
+    epoch = atomic_load(&self_p->readers.epoch);
+    table_pp = &self_p->retired_p;
+
+    while (*table_pp != NULL) {
+        table_p = *table_pp;
+
+        if (epoch - table_p->retired_epoch >= 2) {
+            *table_pp = table_p->next_p;
+            table_delete(table_p);
+        } else {
+            table_pp = &table_p->next_p;
+        }
+    }
+}
+
+/**
+ * Publish a new table built from the subscription list and retire
+ * the old one, together with given unsubscribed subscriber, if
+ * any. Must be called with the mutex locked.
+ */
+static void publish_table(struct ml_bus_t *self_p,
+                          struct ml_bus_subscriber_t *unsubscribed_p)
+{
+    struct ml_bus_table_t *table_p;
+
+    table_p = atomic_exchange(&self_p->table_p, build_table(self_p));
+    table_p->retired_epoch = atomic_load(&self_p->readers.epoch);
+    table_p->unsubscribed_p = unsubscribed_p;
+    table_p->next_p = self_p->retired_p;
+    self_p->retired_p = table_p;
+    reclaim_tables(self_p);
 }
 
 void ml_bus_init(struct ml_bus_t *self_p)
 {
+    pthread_mutex_init(&self_p->mutex, NULL);
     self_p->number_of_elems = 0;
     self_p->elems_p = xmalloc(1);
+    atomic_init(&self_p->table_p, build_table(self_p));
+    self_p->retired_p = NULL;
+    atomic_init(&self_p->readers.epoch, 0);
+    atomic_init(&self_p->readers.counts[0], 0);
+    atomic_init(&self_p->readers.counts[1], 0);
 }
 
 void ml_bus_broadcast(struct ml_bus_t *self_p, void *message_p)
 {
-    struct ml_bus_elem_t *elem_p;
+    struct slot_t *slot_p;
+    atomic_int *count_p;
     int i;
 
-    elem_p = find_element(self_p, message_to_header(message_p)->uid_p);
+    count_p = &self_p->readers.counts[atomic_load(&self_p->readers.epoch) & 1];
+    atomic_fetch_add(count_p, 1);
+    slot_p = find_slot(atomic_load(&self_p->table_p),
+                       message_to_header(message_p)->uid_p);
 
-    if (elem_p != NULL) {
-        ml_message_share(message_p, elem_p->number_of_queues - 1);
+    if (slot_p != NULL) {
+        ml_message_share(message_p, slot_p->number_of_subscribers - 1);
 
-        for (i = 0; i < elem_p->number_of_queues; i++) {
-            ml_queue_put(elem_p->queues_pp[i], message_p);
+        for (i = 0; i < slot_p->number_of_subscribers; i++) {
+            subscriber_put(slot_p->subscribers_pp[i], message_p);
         }
     } else {
         ml_message_free(message_p);
     }
+
+    atomic_fetch_sub_explicit(count_p, 1, memory_order_release);
 }
 
 void ml_bus_subscribe(struct ml_bus_t *self_p,
                       struct ml_queue_t *queue_p,
                       struct ml_uid_t *uid_p)
+{
+    ml_bus_subscribe_with_policy(self_p,
+                                 queue_p,
+                                 uid_p,
+                                 ml_bus_overflow_policy_block_t);
+}
+
+void ml_bus_subscribe_with_policy(struct ml_bus_t *self_p,
+                                  struct ml_queue_t *queue_p,
+                                  struct ml_uid_t *uid_p,
+                                  enum ml_bus_overflow_policy_t policy)
 {
     struct ml_bus_elem_t *elem_p;
 
+    pthread_mutex_lock(&self_p->mutex);
     elem_p = find_element(self_p, uid_p);
 
     if (elem_p == NULL) {
-        insert_element(self_p, uid_p);
-        elem_p = find_element(self_p, uid_p);
+        elem_p = insert_element(self_p, uid_p);
     }
 
-    append_queue_to_element(elem_p, queue_p);
+    append_subscriber_to_element(elem_p, subscriber_new(queue_p, uid_p, policy));
+    publish_table(self_p, NULL);
+    pthread_mutex_unlock(&self_p->mutex);
+}
+
+int ml_bus_unsubscribe(struct ml_bus_t *self_p,
+                       struct ml_queue_t *queue_p,
+                       struct ml_uid_t *uid_p)
+{
+    struct ml_bus_elem_t *elem_p;
+    struct ml_bus_subscriber_t *subscriber_p;
+    int index;
+    int res;
+
+    res = -ENOENT;
+    pthread_mutex_lock(&self_p->mutex);
+    elem_p = find_element(self_p, uid_p);
+
+    if (elem_p != NULL) {
+        subscriber_p = find_subscriber(elem_p, queue_p, &index);
+
+        if (subscriber_p != NULL) {
+            remove_subscriber_from_element(elem_p, index);
+
+            if (elem_p->number_of_subscribers == 0) {
+                remove_element(self_p, elem_p);
+            }
+
+            publish_table(self_p, subscriber_p);
+            res = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&self_p->mutex);
+
+    return (res);
+}
+
+long long ml_bus_get_number_of_drops(struct ml_bus_t *self_p,
+                                     struct ml_queue_t *queue_p,
+                                     struct ml_uid_t *uid_p)
+{
+    struct ml_bus_elem_t *elem_p;
+    struct ml_bus_subscriber_t *subscriber_p;
+    long long res;
+    int index;
+
+    res = -ENOENT;
+    pthread_mutex_lock(&self_p->mutex);
+    elem_p = find_element(self_p, uid_p);
+
+    if (elem_p != NULL) {
+        subscriber_p = find_subscriber(elem_p, queue_p, &index);
+
+        if (subscriber_p != NULL) {
+            res = (long long)atomic_load(&subscriber_p->number_of_drops);
+        }
+    }
+
+    pthread_mutex_unlock(&self_p->mutex);
+
+    return (res);
 }
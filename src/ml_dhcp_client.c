@@ -1180,7 +1180,7 @@ static int setup_timer(struct ml_dhcp_client_t *self_p,
 {
     int fd;
 
-    fd = timerfd_create(CLOCK_REALTIME, 0);
+    fd = timerfd_create(CLOCK_BOOTTIME, 0);
 
     if (fd != -1) {
         init_pollfd(&self_p->fds[index], fd);
@@ -26,12 +26,16 @@
  * This file is part of the Monolinux C library project.
  */
 
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
 #include "ml/ml.h"
+#include "internal.h"
 
 int ml_finit_module(int fd, const char *params_p, int flags)
 {
@@ -43,6 +47,257 @@ int ml_remove_module(const char *module_p, int flags)
     return (syscall(__NR_delete_module, module_p, flags));
 }
 
+int ml_futex_wait(atomic_uint *futex_p,
+                  unsigned int value,
+                  const struct timespec *deadline_p)
+{
+    return (syscall(SYS_futex,
+                    futex_p,
+                    FUTEX_WAIT_BITSET_PRIVATE,
+                    value,
+                    deadline_p,
+                    NULL,
+                    FUTEX_BITSET_MATCH_ANY));
+}
+
+int ml_futex_wake(atomic_uint *futex_p, int count)
+{
+    return (syscall(SYS_futex,
+                    futex_p,
+                    FUTEX_WAKE_PRIVATE,
+                    count,
+                    NULL,
+                    NULL,
+                    0));
+}
+
+struct timespec *ml_make_deadline(struct timespec *deadline_p, int timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline_p);
+    deadline_p->tv_sec += (timeout / 1000);
+    deadline_p->tv_nsec += (1000000L * (timeout % 1000));
+
+    if (deadline_p->tv_nsec >= 1000000000L) {
+        deadline_p->tv_sec++;
+        deadline_p->tv_nsec -= 1000000000L;
+    }
+
+    return (deadline_p);
+}
+
+void ml_waiters_init(struct ml_waiters_t *self_p)
+{
+    atomic_init(&self_p->sequence, 0);
+    atomic_init(&self_p->count, 0);
+}
+
+unsigned int ml_waiters_enter(struct ml_waiters_t *self_p)
+{
+    unsigned int sequence;
+
+    atomic_fetch_add(&self_p->count, 1);
+    sequence = atomic_load(&self_p->sequence);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return (sequence);
+}
+
+int ml_waiters_wait(struct ml_waiters_t *self_p,
+                    unsigned int sequence,
+                    const struct timespec *deadline_p)
+{
+    int res;
+
+    res = ml_futex_wait(&self_p->sequence, sequence, deadline_p);
+
+    if ((res == -1) && (errno == ETIMEDOUT)) {
+        return (-ETIMEDOUT);
+    }
+
+    return (0);
+}
+
+void ml_waiters_leave(struct ml_waiters_t *self_p)
+{
+    atomic_fetch_sub(&self_p->count, 1);
+}
+
+void ml_waiters_signal(struct ml_waiters_t *self_p, int count)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&self_p->count, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&self_p->sequence, 1);
+        ml_futex_wake(&self_p->sequence, count);
+    }
+}
+
+static unsigned int round_up_to_power_of_two(int length)
+{
+    unsigned int size;
+
+    size = 2;
+
+    while (size < (unsigned int)length) {
+        size *= 2;
+    }
+
+    return (size);
+}
+
+static atomic_uint *ring_sequence(struct ml_ring_t *self_p, unsigned int pos)
+{
+    return ((atomic_uint *)ml_ring_cell(self_p, pos));
+}
+
+/**
+ * A cell at position pos is free when its sequence number is pos,
+ * and readable when it is pos + 1.
+ */
+static int ring_try_claim(struct ml_ring_t *self_p,
+                          atomic_uint *position_p,
+                          unsigned int offset,
+                          int length,
+                          unsigned int *pos_p)
+{
+    unsigned int pos;
+    int count;
+    int diff;
+
+    pos = atomic_load_explicit(position_p, memory_order_relaxed);
+
+    while (true) {
+        count = 0;
+        diff = 0;
+
+        while (count < length) {
+            diff = (int)(atomic_load_explicit(ring_sequence(self_p,
+                                                            pos + count),
+                                              memory_order_acquire)
+                         - (pos + count + offset));
+
+            if (diff != 0) {
+                break;
+            }
+
+            count++;
+        }
+
+        if (count > 0) {
+            if (atomic_compare_exchange_weak_explicit(position_p,
+                                                      &pos,
+                                                      pos + count,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return (0);
+        } else {
+            pos = atomic_load_explicit(position_p, memory_order_relaxed);
+        }
+    }
+
+    *pos_p = pos;
+
+    return (count);
+}
+
+void ml_ring_init(struct ml_ring_t *self_p, int length, size_t cell_size)
+{
+    unsigned int size;
+    unsigned int i;
+
+    size = round_up_to_power_of_two(length);
+    self_p->mask = (size - 1);
+    self_p->cell_size = cell_size;
+    self_p->cells_p = xmalloc(cell_size * size);
+
+    for (i = 0; i < size; i++) {
+        atomic_init(ring_sequence(self_p, i), i);
+    }
+
+    atomic_init(&self_p->wrpos, 0);
+    atomic_init(&self_p->rdpos, 0);
+}
+
+void ml_ring_destroy(struct ml_ring_t *self_p)
+{
+    free(self_p->cells_p);
+}
+
+int ml_ring_try_claim_write(struct ml_ring_t *self_p,
+                            int length,
+                            unsigned int *pos_p)
+{
+    return (ring_try_claim(self_p, &self_p->wrpos, 0, length, pos_p));
+}
+
+void ml_ring_publish(struct ml_ring_t *self_p, unsigned int pos)
+{
+    atomic_store_explicit(ring_sequence(self_p, pos),
+                          pos + 1,
+                          memory_order_release);
+}
+
+int ml_ring_try_claim_read(struct ml_ring_t *self_p,
+                           int length,
+                           unsigned int *pos_p)
+{
+    return (ring_try_claim(self_p, &self_p->rdpos, 1, length, pos_p));
+}
+
+bool ml_ring_peek(struct ml_ring_t *self_p, unsigned int *pos_p)
+{
+    unsigned int pos;
+
+    pos = atomic_load_explicit(&self_p->rdpos, memory_order_relaxed);
+    *pos_p = pos;
+
+    return (atomic_load_explicit(ring_sequence(self_p, pos),
+                                 memory_order_acquire) == pos + 1);
+}
+
+bool ml_ring_try_claim_read_at(struct ml_ring_t *self_p, unsigned int pos)
+{
+    return (atomic_compare_exchange_strong_explicit(&self_p->rdpos,
+                                                    &pos,
+                                                    pos + 1,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+}
+
+void ml_ring_release(struct ml_ring_t *self_p, unsigned int pos)
+{
+    atomic_store_explicit(ring_sequence(self_p, pos),
+                          pos + self_p->mask + 1,
+                          memory_order_release);
+}
+
+bool ml_ring_is_empty(struct ml_ring_t *self_p)
+{
+    unsigned int pos;
+
+    pos = atomic_load(&self_p->rdpos);
+
+    return ((int)(atomic_load(ring_sequence(self_p, pos)) - (pos + 1)) < 0);
+}
+
+unsigned int ml_ring_get_length(struct ml_ring_t *self_p)
+{
+    unsigned int rdpos;
+    unsigned int wrpos;
+
+    rdpos = atomic_load(&self_p->rdpos);
+    wrpos = atomic_load(&self_p->wrpos);
+
+    if ((int)(wrpos - rdpos) <= 0) {
+        return (0);
+    }
+
+    return (wrpos - rdpos);
+}
+
 #if defined(__GNU_LIBRARY__) && (__GLIBC__ <= 2) && (__GLIBC_MINOR__ <= 26)
 
 int memfd_create(const char *name, unsigned flags)
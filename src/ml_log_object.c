@@ -26,15 +26,111 @@
  * This file is part of the Monolinux C library project.
  */
 
+/*
+ * In asynchronous mode each logging thread formats the message of an
+ * entry into its own single producer, single consumer ring of
+ * records. A background writer thread merges the rings in time
+ * order, formats the timestamp, level and log object name of each
+ * record, and writes many entries with a single writev() call. Rings
+ * of exited threads are reused by new threads.
+ *
+ * In binary mode entries are not formatted at all when printed.
+ * Instead the format string address, a timestamp and the arguments
+ * are packed into a record in a circular buffer, overwriting the
+ * oldest records when full. Records are formatted when rendered, or
+ * offline by 'ml decode_log' from a dump of the buffer.
+ */
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <sys/param.h>
+#include <sys/uio.h>
 #include "ml/ml.h"
 #include "internal.h"
 
+/* Number of records in each thread's ring. */
+#define RING_SIZE                                           64
+
+/* Maximum number of entries written at once. */
+#define BATCH_SIZE                                          64
+
+#define RECORD_TEXT_SIZE                                    464
+
+struct record_t {
+    struct timespec time;
+    int level;
+    const char *name_p;
+    int length;
+    char text[RECORD_TEXT_SIZE];
+};
+
+struct ring_t {
+    atomic_uint wrpos;
+    char padding_1[ML_CACHE_LINE_SIZE];
+    atomic_uint rdpos;
+    /* Only used by the writer. */
+    unsigned int cursor;
+    char padding_2[ML_CACHE_LINE_SIZE];
+    struct ml_waiters_t not_full;
+    /* Protected by the async mutex. */
+    bool is_orphaned;
+    struct ring_t *next_p;
+    struct record_t records[RING_SIZE];
+};
+
+struct ring_flush_t {
+    struct ring_t *ring_p;
+    unsigned int wrpos;
+};
+
+/* Bytes per hexdump line. */
+#define HEXDUMP_LINE_BYTES                                  16
+
+/* Offset, bytes, ASCII and newline. */
+#define HEXDUMP_LINE_SIZE                                   80
+
+/* Maximum number of hexdump lines written at once. */
+#define HEXDUMP_BATCH_SIZE                                  32
+
+#define BINARY_DUMP_MAGIC                                   "MLLOGBIN"
+
+/* Maximum size of a binary record, including the header. */
+#define BINARY_RECORD_SIZE                                  512
+
+/* Size, level, time, name address and format address. */
+#define BINARY_RECORD_HEADER_SIZE                           27
+
+#define BINARY_STRING_SIZE                                  255
+
+struct binary_header_t {
+    int size;
+    int level;
+    uint64_t time;
+    const char *name_p;
+    const char *fmt_p;
+};
+
+struct spec_t {
+    char flags[8];
+    char width[16];
+    char precision[16];
+    bool is_width_star;
+    bool is_precision_star;
+    bool has_precision;
+    /* One of "hh", "h", "l", "ll", "L", "j", "z" and "t", or empty. */
+    char length[3];
+    char conversion;
+};
+
 /**
  * Module state (log levels).
  */
@@ -45,13 +141,52 @@
 struct module_t {
     const char *log_object_path_p;
     int fd;
+    bool is_kmsg;
+    atomic_bool is_milliseconds_enabled;
     struct ml_log_object_t log_object;
     struct ml_log_object_t *head_p;
+    struct {
+        atomic_bool is_started;
+        pthread_once_t once;
+        pthread_mutex_t mutex;
+        pthread_key_t key;
+        struct ring_t *_Atomic rings_p;
+        struct ml_waiters_t not_empty;
+        struct ml_waiters_t written;
+        pthread_t pthread;
+    } async;
+    struct {
+        atomic_bool is_started;
+        pthread_mutex_t mutex;
+        uint8_t *buf_p;
+        size_t size;
+        /* Positions in bytes since start. */
+        uint64_t rdpos;
+        uint64_t wrpos;
+    } binary;
 };
 
 static struct module_t module = {
     .fd = STDOUT_FILENO,
-    .head_p = NULL
+    .is_kmsg = false,
+    .head_p = NULL,
+    .async = {
+        .once = PTHREAD_ONCE_INIT,
+        .mutex = PTHREAD_MUTEX_INITIALIZER
+    },
+    .binary = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER
+    }
+};
+
+static __thread struct ring_t *thread_ring_p = NULL;
+
+static __thread struct {
+    time_t second;
+    size_t length;
+    char text[32];
+} time_cache = {
+    .second = -1
 };
 
 static const char *level_to_string_upper(int level)
@@ -100,6 +235,67 @@ static const char *level_to_string_upper(int level)
     return (name_p);
 }
 
+/**
+ * Format given time, reusing the date and time of the previous call
+ * in this thread if in the same second.
+ */
+static size_t format_time(char *buf_p,
+                          size_t size,
+                          const struct timespec *time_p)
+{
+    struct tm tm;
+    size_t length;
+
+    if (time_p->tv_sec != time_cache.second) {
+        gmtime_r(&time_p->tv_sec, &tm);
+        time_cache.length = strftime(&time_cache.text[0],
+                                     sizeof(time_cache.text),
+                                     "%F %T",
+                                     &tm);
+
+        if (time_cache.length > 0) {
+            time_cache.second = time_p->tv_sec;
+        }
+    }
+
+    length = MIN(time_cache.length, size - 1);
+    memcpy(buf_p, &time_cache.text[0], length);
+
+    if (atomic_load_explicit(&module.is_milliseconds_enabled,
+                             memory_order_relaxed)) {
+        length += snprintf(&buf_p[length],
+                           size - length,
+                           ".%03ld",
+                           time_p->tv_nsec / 1000000);
+    }
+
+    buf_p[length] = '\0';
+
+    return (length);
+}
+
+static size_t format_prefix(char *buf_p,
+                            size_t size,
+                            const struct timespec *time_p,
+                            int level,
+                            const char *name_p)
+{
+    size_t length;
+
+    length = format_time(buf_p, size, time_p);
+    length += snprintf(&buf_p[length],
+                       size - length,
+                       " %s %s ",
+                       level_to_string_upper(level),
+                       name_p);
+
+    if (length >= size) {
+        length = (size - 1);
+    }
+
+    return (length);
+}
+
 void ml_log_object_module_init(const char *log_object_path_p)
 {
     if (log_object_path_p == NULL) {
@@ -113,6 +309,7 @@ void ml_log_object_module_init(const char *log_object_path_p)
        kernel. If not, lots of log messages will be dropped due to
        rate limiting. */
     module.fd = open("/dev/kmsg", O_WRONLY);
+    module.is_kmsg = true;
 #endif
 
     ml_log_object_init(&module.log_object, "log-object", ML_LOG_INFO);
@@ -328,14 +525,1024 @@ bool ml_log_object_is_enabled_for(struct ml_log_object_t *self_p,
     return (level <= self_p->level);
 }
 
+static void ring_orphan(void *arg_p)
+{
+    struct ring_t *ring_p;
+
+    ring_p = (struct ring_t *)arg_p;
+    pthread_mutex_lock(&module.async.mutex);
+    ring_p->is_orphaned = true;
+    pthread_mutex_unlock(&module.async.mutex);
+}
+
+static struct ring_t *ring_alloc(void)
+{
+    struct ring_t *ring_p;
+
+    ring_p = xmalloc(sizeof(*ring_p));
+    atomic_init(&ring_p->wrpos, 0);
+    atomic_init(&ring_p->rdpos, 0);
+    ring_p->cursor = 0;
+    ml_waiters_init(&ring_p->not_full);
+    ring_p->is_orphaned = false;
+    ring_p->next_p = atomic_load(&module.async.rings_p);
+    atomic_store_explicit(&module.async.rings_p,
+                          ring_p,
+                          memory_order_release);
+
+    return (ring_p);
+}
+
+/**
+ * Returns the calling thread's ring, reusing the ring of an exited
+ * thread if possible.
+ */
+static struct ring_t *thread_ring_get(void)
+{
+    struct ring_t *ring_p;
+
+    if (thread_ring_p != NULL) {
+        return (thread_ring_p);
+    }
+
+    pthread_mutex_lock(&module.async.mutex);
+    ring_p = atomic_load(&module.async.rings_p);
+
+    while (ring_p != NULL) {
+        if (ring_p->is_orphaned) {
+            ring_p->is_orphaned = false;
+            break;
+        }
+
+        ring_p = ring_p->next_p;
+    }
+
+    if (ring_p == NULL) {
+        ring_p = ring_alloc();
+    }
+
+    pthread_mutex_unlock(&module.async.mutex);
+    pthread_setspecific(module.async.key, ring_p);
+    thread_ring_p = ring_p;
+
+    return (ring_p);
+}
+
+static void async_vprint(struct ml_log_object_t *self_p,
+                         int level,
+                         const char *fmt_p,
+                         va_list vlist)
+{
+    struct ring_t *ring_p;
+    struct record_t *record_p;
+    unsigned int pos;
+    unsigned int sequence;
+    int length;
+
+    ring_p = thread_ring_get();
+    pos = atomic_load_explicit(&ring_p->wrpos, memory_order_relaxed);
+
+    while (pos - atomic_load_explicit(&ring_p->rdpos, memory_order_acquire)
+           >= RING_SIZE) {
+        sequence = ml_waiters_enter(&ring_p->not_full);
+
+        if (pos - atomic_load(&ring_p->rdpos) >= RING_SIZE) {
+            ml_waiters_wait(&ring_p->not_full, sequence, NULL);
+        }
+
+        ml_waiters_leave(&ring_p->not_full);
+    }
+
+    record_p = &ring_p->records[pos % RING_SIZE];
+    clock_gettime(CLOCK_REALTIME, &record_p->time);
+    record_p->level = level;
+    record_p->name_p = self_p->name_p;
+    length = vsnprintf(&record_p->text[0],
+                       sizeof(record_p->text),
+                       fmt_p,
+                       vlist);
+
+    if (length >= (int)sizeof(record_p->text)) {
+        length = (sizeof(record_p->text) - 1);
+    } else if (length < 0) {
+        length = 0;
+    }
+
+    record_p->length = length;
+    atomic_store_explicit(&ring_p->wrpos, pos + 1, memory_order_release);
+    ml_waiters_signal(&module.async.not_empty, 1);
+}
+
+static bool is_older(struct record_t *record_p, struct record_t *other_p)
+{
+    if (record_p->time.tv_sec != other_p->time.tv_sec) {
+        return (record_p->time.tv_sec < other_p->time.tv_sec);
+    }
+
+    return (record_p->time.tv_nsec < other_p->time.tv_nsec);
+}
+
+/**
+ * Take up to given number of the oldest records from all rings. The
+ * records are not released until written.
+ */
+static int collect_records(struct record_t **records_pp, int length)
+{
+    struct ring_t *ring_p;
+    struct ring_t *oldest_ring_p;
+    struct record_t *record_p;
+    struct record_t *oldest_p;
+    int number_of_records;
+
+    number_of_records = 0;
+
+    while (number_of_records < length) {
+        oldest_p = NULL;
+        oldest_ring_p = NULL;
+        ring_p = atomic_load_explicit(&module.async.rings_p,
+                                      memory_order_acquire);
+
+        while (ring_p != NULL) {
+            if (ring_p->cursor != atomic_load_explicit(&ring_p->wrpos,
+                                                       memory_order_acquire)) {
+                record_p = &ring_p->records[ring_p->cursor % RING_SIZE];
+
+                if ((oldest_p == NULL) || is_older(record_p, oldest_p)) {
+                    oldest_p = record_p;
+                    oldest_ring_p = ring_p;
+                }
+            }
+
+            ring_p = ring_p->next_p;
+        }
+
+        if (oldest_p == NULL) {
+            break;
+        }
+
+        records_pp[number_of_records++] = oldest_p;
+        oldest_ring_p->cursor++;
+    }
+
+    return (number_of_records);
+}
+
+static void release_records(void)
+{
+    struct ring_t *ring_p;
+
+    ring_p = atomic_load_explicit(&module.async.rings_p, memory_order_acquire);
+
+    while (ring_p != NULL) {
+        if (ring_p->cursor != atomic_load_explicit(&ring_p->rdpos,
+                                                   memory_order_relaxed)) {
+            atomic_store_explicit(&ring_p->rdpos,
+                                  ring_p->cursor,
+                                  memory_order_release);
+            ml_waiters_signal(&ring_p->not_full, 1);
+        }
+
+        ring_p = ring_p->next_p;
+    }
+
+    ml_waiters_signal(&module.async.written, INT_MAX);
+}
+
+/**
+ * Each write to /dev/kmsg is one log entry, so entries are written
+ * one by one to it, but all at once to anything else.
+ */
+static void write_records(struct record_t **records_pp, int length)
+{
+    static char prefixes[BATCH_SIZE][96];
+    struct iovec iov[3 * BATCH_SIZE];
+    struct record_t *record_p;
+    ssize_t written;
+    int i;
+
+    for (i = 0; i < length; i++) {
+        record_p = records_pp[i];
+        iov[3 * i].iov_base = &prefixes[i][0];
+        iov[3 * i].iov_len = format_prefix(&prefixes[i][0],
+                                           sizeof(prefixes[i]),
+                                           &record_p->time,
+                                           record_p->level,
+                                           record_p->name_p);
+        iov[3 * i + 1].iov_base = &record_p->text[0];
+        iov[3 * i + 1].iov_len = (size_t)record_p->length;
+        iov[3 * i + 2].iov_base = "\n";
+        iov[3 * i + 2].iov_len = 1;
+
+        if (module.is_kmsg) {
+            written = writev(module.fd, &iov[3 * i], 3);
+            (void)written;
+        }
+    }
+
+    if (!module.is_kmsg) {
+        written = writev(module.fd, &iov[0], 3 * length);
+        (void)written;
+    }
+}
+
+static bool is_any_ring_non_empty(void)
+{
+    struct ring_t *ring_p;
+
+    ring_p = atomic_load_explicit(&module.async.rings_p, memory_order_acquire);
+
+    while (ring_p != NULL) {
+        if (ring_p->cursor != atomic_load(&ring_p->wrpos)) {
+            return (true);
+        }
+
+        ring_p = ring_p->next_p;
+    }
+
+    return (false);
+}
+
+static void *writer_main(void *arg_p)
+{
+    struct record_t *records[BATCH_SIZE];
+    unsigned int sequence;
+    int length;
+
+    (void)arg_p;
+
+    pthread_setname_np(pthread_self(), "ml_log_writer");
+
+    while (true) {
+        length = collect_records(&records[0], BATCH_SIZE);
+
+        if (length == 0) {
+            sequence = ml_waiters_enter(&module.async.not_empty);
+
+            if (!is_any_ring_non_empty()) {
+                ml_waiters_wait(&module.async.not_empty, sequence, NULL);
+            }
+
+            ml_waiters_leave(&module.async.not_empty);
+            continue;
+        }
+
+        write_records(&records[0], length);
+        release_records();
+    }
+
+    return (NULL);
+}
+
+static void async_init(void)
+{
+    pthread_key_create(&module.async.key, ring_orphan);
+    atomic_init(&module.async.rings_p, NULL);
+    ml_waiters_init(&module.async.not_empty);
+    ml_waiters_init(&module.async.written);
+    pthread_create(&module.async.pthread, NULL, writer_main, NULL);
+    atomic_store(&module.async.is_started, true);
+}
+
+void ml_log_object_module_set_milliseconds(bool enabled)
+{
+    atomic_store(&module.is_milliseconds_enabled, enabled);
+}
+
+void ml_log_object_module_start_writer(void)
+{
+    pthread_once(&module.async.once, async_init);
+}
+
+static bool is_flushed(struct ring_flush_t *flushes_p, int length)
+{
+    int i;
+
+    for (i = 0; i < length; i++) {
+        if ((int)(atomic_load(&flushes_p[i].ring_p->rdpos)
+                  - flushes_p[i].wrpos) < 0) {
+            return (false);
+        }
+    }
+
+    return (true);
+}
+
+void ml_log_object_flush(void)
+{
+    struct ring_flush_t *flushes_p;
+    struct ring_t *ring_p;
+    unsigned int sequence;
+    int length;
+    int i;
+
+    if (!atomic_load(&module.async.is_started)) {
+        return;
+    }
+
+    pthread_mutex_lock(&module.async.mutex);
+    length = 0;
+    ring_p = atomic_load(&module.async.rings_p);
+
+    while (ring_p != NULL) {
+        length++;
+        ring_p = ring_p->next_p;
+    }
+
+    flushes_p = xmalloc(sizeof(*flushes_p) * (size_t)(length + 1));
+    ring_p = atomic_load(&module.async.rings_p);
+
+    for (i = 0; i < length; i++) {
+        flushes_p[i].ring_p = ring_p;
+        flushes_p[i].wrpos = atomic_load(&ring_p->wrpos);
+        ring_p = ring_p->next_p;
+    }
+
+    pthread_mutex_unlock(&module.async.mutex);
+
+    while (!is_flushed(flushes_p, length)) {
+        sequence = ml_waiters_enter(&module.async.written);
+
+        if (!is_flushed(flushes_p, length)) {
+            ml_waiters_wait(&module.async.written, sequence, NULL);
+        }
+
+        ml_waiters_leave(&module.async.written);
+    }
+
+    free(flushes_p);
+}
+
+/**
+ * Parse a conversion specification, just after its '%'. Returns a
+ * pointer just after the specification.
+ */
+static const char *parse_spec(const char *fmt_p, struct spec_t *spec_p)
+{
+    size_t i;
+
+    memset(spec_p, 0, sizeof(*spec_p));
+    i = 0;
+
+    while ((*fmt_p != '\0') && (strchr("-+ #0", *fmt_p) != NULL)) {
+        if (i < sizeof(spec_p->flags) - 1) {
+            spec_p->flags[i++] = *fmt_p;
+        }
+
+        fmt_p++;
+    }
+
+    if (*fmt_p == '*') {
+        spec_p->is_width_star = true;
+        fmt_p++;
+    } else {
+        i = 0;
+
+        while (isdigit((unsigned char)*fmt_p)) {
+            if (i < sizeof(spec_p->width) - 1) {
+                spec_p->width[i++] = *fmt_p;
+            }
+
+            fmt_p++;
+        }
+    }
+
+    if (*fmt_p == '.') {
+        spec_p->has_precision = true;
+        fmt_p++;
+
+        if (*fmt_p == '*') {
+            spec_p->is_precision_star = true;
+            fmt_p++;
+        } else {
+            i = 0;
+
+            while (isdigit((unsigned char)*fmt_p)) {
+                if (i < sizeof(spec_p->precision) - 1) {
+                    spec_p->precision[i++] = *fmt_p;
+                }
+
+                fmt_p++;
+            }
+        }
+    }
+
+    i = 0;
+
+    while ((*fmt_p != '\0')
+           && (strchr("hlLqjzZt", *fmt_p) != NULL)
+           && (i < sizeof(spec_p->length) - 1)) {
+        spec_p->length[i++] = *fmt_p++;
+    }
+
+    spec_p->conversion = *fmt_p;
+
+    if (*fmt_p != '\0') {
+        fmt_p++;
+    }
+
+    return (fmt_p);
+}
+
+static bool pack(uint8_t **buf_pp,
+                 uint8_t *end_p,
+                 const void *value_p,
+                 size_t size)
+{
+    if ((size_t)(end_p - *buf_pp) < size) {
+        return (false);
+    }
+
+    memcpy(*buf_pp, value_p, size);
+    *buf_pp += size;
+
+    return (true);
+}
+
+static bool pack_int64(uint8_t **buf_pp, uint8_t *end_p, int64_t value)
+{
+    return (pack(buf_pp, end_p, &value, sizeof(value)));
+}
+
+static bool pack_string(uint8_t **buf_pp,
+                        uint8_t *end_p,
+                        const char *string_p,
+                        size_t maximum_length)
+{
+    uint8_t length;
+
+    if (string_p == NULL) {
+        string_p = "(null)";
+    }
+
+    if (maximum_length > BINARY_STRING_SIZE) {
+        maximum_length = BINARY_STRING_SIZE;
+    }
+
+    length = (uint8_t)strnlen(string_p, maximum_length);
+
+    if (!pack(buf_pp, end_p, &length, sizeof(length))) {
+        return (false);
+    }
+
+    return (pack(buf_pp, end_p, string_p, length));
+}
+
+static bool pack_signed(uint8_t **buf_pp,
+                        uint8_t *end_p,
+                        const char *length_p,
+                        va_list *vlist_p)
+{
+    int64_t value;
+
+    if (strcmp(length_p, "hh") == 0) {
+        value = (signed char)va_arg(*vlist_p, int);
+    } else if (strcmp(length_p, "h") == 0) {
+        value = (short)va_arg(*vlist_p, int);
+    } else if (strcmp(length_p, "l") == 0) {
+        value = va_arg(*vlist_p, long);
+    } else if ((strcmp(length_p, "ll") == 0) || (strcmp(length_p, "q") == 0)) {
+        value = va_arg(*vlist_p, long long);
+    } else if (strcmp(length_p, "j") == 0) {
+        value = va_arg(*vlist_p, intmax_t);
+    } else if ((strcmp(length_p, "z") == 0) || (strcmp(length_p, "Z") == 0)) {
+        value = va_arg(*vlist_p, ssize_t);
+    } else if (strcmp(length_p, "t") == 0) {
+        value = va_arg(*vlist_p, ptrdiff_t);
+    } else {
+        value = va_arg(*vlist_p, int);
+    }
+
+    return (pack_int64(buf_pp, end_p, value));
+}
+
+static bool pack_unsigned(uint8_t **buf_pp,
+                          uint8_t *end_p,
+                          const char *length_p,
+                          va_list *vlist_p)
+{
+    uint64_t value;
+
+    if (strcmp(length_p, "hh") == 0) {
+        value = (unsigned char)va_arg(*vlist_p, unsigned int);
+    } else if (strcmp(length_p, "h") == 0) {
+        value = (unsigned short)va_arg(*vlist_p, unsigned int);
+    } else if (strcmp(length_p, "l") == 0) {
+        value = va_arg(*vlist_p, unsigned long);
+    } else if ((strcmp(length_p, "ll") == 0) || (strcmp(length_p, "q") == 0)) {
+        value = va_arg(*vlist_p, unsigned long long);
+    } else if (strcmp(length_p, "j") == 0) {
+        value = va_arg(*vlist_p, uintmax_t);
+    } else if ((strcmp(length_p, "z") == 0) || (strcmp(length_p, "Z") == 0)) {
+        value = va_arg(*vlist_p, size_t);
+    } else if (strcmp(length_p, "t") == 0) {
+        value = (uint64_t)va_arg(*vlist_p, ptrdiff_t);
+    } else {
+        value = va_arg(*vlist_p, unsigned int);
+    }
+
+    return (pack(buf_pp, end_p, &value, sizeof(value)));
+}
+
+/**
+ * Pack all arguments of given format string. Strings are copied as
+ * they may not outlive the call. Returns false if the arguments do
+ * not fit or the format string is not supported.
+ */
+static bool pack_arguments(uint8_t **buf_pp,
+                           uint8_t *end_p,
+                           const char *fmt_p,
+                           va_list *vlist_p)
+{
+    struct spec_t spec;
+    int precision;
+    double value;
+    bool ok;
+
+    while (*fmt_p != '\0') {
+        if (*fmt_p++ != '%') {
+            continue;
+        }
+
+        if (*fmt_p == '%') {
+            fmt_p++;
+            continue;
+        }
+
+        fmt_p = parse_spec(fmt_p, &spec);
+
+        if (spec.is_width_star) {
+            if (!pack_int64(buf_pp, end_p, va_arg(*vlist_p, int))) {
+                return (false);
+            }
+        }
+
+        precision = -1;
+
+        if (spec.is_precision_star) {
+            precision = va_arg(*vlist_p, int);
+
+            if (!pack_int64(buf_pp, end_p, precision)) {
+                return (false);
+            }
+        } else if (spec.has_precision) {
+            precision = atoi(&spec.precision[0]);
+        }
+
+        switch (spec.conversion) {
+
+        case 'd':
+        case 'i':
+            ok = pack_signed(buf_pp, end_p, &spec.length[0], vlist_p);
+            break;
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            ok = pack_unsigned(buf_pp, end_p, &spec.length[0], vlist_p);
+            break;
+
+        case 'c':
+            ok = pack_int64(buf_pp, end_p, va_arg(*vlist_p, int));
+            break;
+
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (strcmp(&spec.length[0], "L") == 0) {
+                value = (double)va_arg(*vlist_p, long double);
+            } else {
+                value = va_arg(*vlist_p, double);
+            }
+
+            ok = pack(buf_pp, end_p, &value, sizeof(value));
+            break;
+
+        case 's':
+            if (spec.length[0] != '\0') {
+                return (false);
+            }
+
+            ok = pack_string(buf_pp,
+                             end_p,
+                             va_arg(*vlist_p, const char *),
+                             precision < 0 ? SIZE_MAX : (size_t)precision);
+            break;
+
+        case 'p':
+            ok = pack_int64(buf_pp,
+                            end_p,
+                            (int64_t)(uintptr_t)va_arg(*vlist_p, void *));
+            break;
+
+        default:
+            return (false);
+        }
+
+        if (!ok) {
+            return (false);
+        }
+    }
+
+    return (true);
+}
+
+static void binary_write(const uint8_t *buf_p, size_t size)
+{
+    size_t offset;
+    size_t length;
+
+    offset = (module.binary.wrpos % module.binary.size);
+    length = MIN(size, module.binary.size - offset);
+    memcpy(&module.binary.buf_p[offset], buf_p, length);
+    memcpy(&module.binary.buf_p[0], &buf_p[length], size - length);
+    module.binary.wrpos += size;
+}
+
+static void binary_read(uint64_t pos, uint8_t *buf_p, size_t size)
+{
+    size_t offset;
+    size_t length;
+
+    offset = (pos % module.binary.size);
+    length = MIN(size, module.binary.size - offset);
+    memcpy(buf_p, &module.binary.buf_p[offset], length);
+    memcpy(&buf_p[length], &module.binary.buf_p[0], size - length);
+}
+
+static void pack_header(uint8_t *buf_p, struct binary_header_t *header_p)
+{
+    uint16_t size;
+    uint8_t level;
+    uint64_t address;
+
+    size = (uint16_t)header_p->size;
+    memcpy(&buf_p[0], &size, sizeof(size));
+    level = (uint8_t)header_p->level;
+    memcpy(&buf_p[2], &level, sizeof(level));
+    memcpy(&buf_p[3], &header_p->time, sizeof(header_p->time));
+    address = (uintptr_t)header_p->name_p;
+    memcpy(&buf_p[11], &address, sizeof(address));
+    address = (uintptr_t)header_p->fmt_p;
+    memcpy(&buf_p[19], &address, sizeof(address));
+}
+
+static void unpack_header(const uint8_t *buf_p,
+                          struct binary_header_t *header_p)
+{
+    uint16_t size;
+    uint64_t address;
+
+    memcpy(&size, &buf_p[0], sizeof(size));
+    header_p->size = size;
+    header_p->level = buf_p[2];
+    memcpy(&header_p->time, &buf_p[3], sizeof(header_p->time));
+    memcpy(&address, &buf_p[11], sizeof(address));
+    header_p->name_p = (const char *)(uintptr_t)address;
+    memcpy(&address, &buf_p[19], sizeof(address));
+    header_p->fmt_p = (const char *)(uintptr_t)address;
+}
+
+static void binary_vprint(struct ml_log_object_t *self_p,
+                          int level,
+                          const char *fmt_p,
+                          va_list vlist)
+{
+    uint8_t buf[BINARY_RECORD_SIZE];
+    uint8_t *buf_p;
+    struct binary_header_t header;
+    struct timespec now;
+    va_list vlist_copy;
+    bool ok;
+    uint16_t oldest_size;
+    char text[BINARY_STRING_SIZE + 1];
+
+    buf_p = &buf[BINARY_RECORD_HEADER_SIZE];
+    va_copy(vlist_copy, vlist);
+    ok = pack_arguments(&buf_p, &buf[sizeof(buf)], fmt_p, &vlist_copy);
+    va_end(vlist_copy);
+
+    /* Fall back to formatting now. */
+    if (!ok) {
+        vsnprintf(&text[0], sizeof(text), fmt_p, vlist);
+        fmt_p = "%s";
+        buf_p = &buf[BINARY_RECORD_HEADER_SIZE];
+        pack_string(&buf_p, &buf[sizeof(buf)], &text[0], SIZE_MAX);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.size = (int)(buf_p - &buf[0]);
+    header.level = level;
+    header.time = ((uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec);
+    header.name_p = self_p->name_p;
+    header.fmt_p = fmt_p;
+    pack_header(&buf[0], &header);
+
+    pthread_mutex_lock(&module.binary.mutex);
+
+    /* Overwrite the oldest records. */
+    while (module.binary.wrpos + (uint64_t)header.size
+           > module.binary.rdpos + module.binary.size) {
+        binary_read(module.binary.rdpos,
+                    (uint8_t *)&oldest_size,
+                    sizeof(oldest_size));
+        module.binary.rdpos += oldest_size;
+    }
+
+    binary_write(&buf[0], (size_t)header.size);
+    pthread_mutex_unlock(&module.binary.mutex);
+}
+
+static bool unpack(const uint8_t **buf_pp,
+                   const uint8_t *end_p,
+                   void *value_p,
+                   size_t size)
+{
+    if ((size_t)(end_p - *buf_pp) < size) {
+        return (false);
+    }
+
+    memcpy(value_p, *buf_pp, size);
+    *buf_pp += size;
+
+    return (true);
+}
+
+/**
+ * Format given packed arguments with given format string, one
+ * conversion specification at a time.
+ */
+static void render_arguments(FILE *fout_p,
+                             const char *fmt_p,
+                             const uint8_t *buf_p,
+                             const uint8_t *end_p)
+{
+    struct spec_t spec;
+    char spec_fmt[64];
+    const char *begin_p;
+    char width[24];
+    char precision[24];
+    int64_t value;
+    double dvalue;
+    uint8_t length;
+    char string[BINARY_STRING_SIZE + 1];
+
+    while (*fmt_p != '\0') {
+        begin_p = fmt_p;
+        fmt_p = strchrnul(fmt_p, '%');
+        fwrite(begin_p, 1, (size_t)(fmt_p - begin_p), fout_p);
+
+        if (*fmt_p == '\0') {
+            break;
+        }
+
+        fmt_p++;
+
+        if (*fmt_p == '%') {
+            fputc('%', fout_p);
+            fmt_p++;
+            continue;
+        }
+
+        fmt_p = parse_spec(fmt_p, &spec);
+        strcpy(&width[0], &spec.width[0]);
+        strcpy(&precision[0], &spec.precision[0]);
+
+        if (spec.is_width_star) {
+            if (!unpack(&buf_p, end_p, &value, sizeof(value))) {
+                return;
+            }
+
+            snprintf(&width[0], sizeof(width), "%d", (int)value);
+        }
+
+        if (spec.is_precision_star) {
+            if (!unpack(&buf_p, end_p, &value, sizeof(value))) {
+                return;
+            }
+
+            if (value < 0) {
+                spec.has_precision = false;
+            } else {
+                snprintf(&precision[0], sizeof(precision), "%d", (int)value);
+            }
+        }
+
+        snprintf(&spec_fmt[0],
+                 sizeof(spec_fmt),
+                 "%%%s%s%s%s%s%c",
+                 &spec.flags[0],
+                 &width[0],
+                 spec.has_precision ? "." : "",
+                 spec.has_precision ? &precision[0] : "",
+                 strchr("diuoxX", spec.conversion) != NULL ? "ll" : "",
+                 spec.conversion);
+
+        switch (spec.conversion) {
+
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+        case 'c':
+            if (!unpack(&buf_p, end_p, &value, sizeof(value))) {
+                return;
+            }
+
+            if (spec.conversion == 'c') {
+                fprintf(fout_p, &spec_fmt[0], (int)value);
+            } else {
+                fprintf(fout_p, &spec_fmt[0], (long long)value);
+            }
+
+            break;
+
+        case 'p':
+            if (!unpack(&buf_p, end_p, &value, sizeof(value))) {
+                return;
+            }
+
+            fprintf(fout_p, &spec_fmt[0], (void *)(uintptr_t)value);
+            break;
+
+        case 's':
+            if (!unpack(&buf_p, end_p, &length, sizeof(length))) {
+                return;
+            }
+
+            if (!unpack(&buf_p, end_p, &string[0], length)) {
+                return;
+            }
+
+            string[length] = '\0';
+            fprintf(fout_p, &spec_fmt[0], &string[0]);
+            break;
+
+        default:
+            if (!unpack(&buf_p, end_p, &dvalue, sizeof(dvalue))) {
+                return;
+            }
+
+            fprintf(fout_p, &spec_fmt[0], dvalue);
+            break;
+        }
+    }
+}
+
+void ml_log_object_module_start_binary(size_t size)
+{
+    pthread_mutex_lock(&module.binary.mutex);
+
+    if (module.binary.buf_p == NULL) {
+        if (size < BINARY_RECORD_SIZE) {
+            size = BINARY_RECORD_SIZE;
+        }
+
+        module.binary.buf_p = xmalloc(size);
+        module.binary.size = size;
+        module.binary.rdpos = 0;
+        module.binary.wrpos = 0;
+        atomic_store(&module.binary.is_started, true);
+    }
+
+    pthread_mutex_unlock(&module.binary.mutex);
+}
+
+/**
+ * Returns a copy of all records, oldest first.
+ */
+static uint8_t *binary_copy(size_t *size_p)
+{
+    uint8_t *buf_p;
+
+    pthread_mutex_lock(&module.binary.mutex);
+    *size_p = (size_t)(module.binary.wrpos - module.binary.rdpos);
+    buf_p = xmalloc(*size_p + 1);
+    binary_read(module.binary.rdpos, buf_p, *size_p);
+    pthread_mutex_unlock(&module.binary.mutex);
+
+    return (buf_p);
+}
+
+void ml_log_object_binary_render(FILE *fout_p)
+{
+    struct binary_header_t header;
+    uint8_t *buf_p;
+    size_t size;
+    size_t offset;
+    struct timespec time;
+    char prefix[96];
+
+    if (!atomic_load(&module.binary.is_started)) {
+        return;
+    }
+
+    buf_p = binary_copy(&size);
+    offset = 0;
+
+    while (offset + BINARY_RECORD_HEADER_SIZE <= size) {
+        unpack_header(&buf_p[offset], &header);
+        time.tv_sec = (time_t)(header.time / 1000000000);
+        time.tv_nsec = (long)(header.time % 1000000000);
+        format_prefix(&prefix[0],
+                      sizeof(prefix),
+                      &time,
+                      header.level,
+                      header.name_p);
+        fputs(&prefix[0], fout_p);
+        render_arguments(fout_p,
+                         header.fmt_p,
+                         &buf_p[offset + BINARY_RECORD_HEADER_SIZE],
+                         &buf_p[offset + (size_t)header.size]);
+        fputc('\n', fout_p);
+        offset += (size_t)header.size;
+    }
+
+    free(buf_p);
+}
+
+/**
+ * The dump starts with a magic string, the address of this function,
+ * to find where the executable was loaded, and the names of all
+ * registered log objects, followed by the records.
+ */
+int ml_log_object_binary_dump(const char *path_p)
+{
+    FILE *file_p;
+    struct ml_log_object_t *log_object_p;
+    uint8_t *buf_p;
+    uint64_t address;
+    uint64_t size;
+    uint32_t number_of_names;
+    uint8_t length;
+    size_t records_size;
+    int res;
+
+    if (!atomic_load(&module.binary.is_started)) {
+        return (-ENODEV);
+    }
+
+    file_p = fopen(path_p, "wb");
+
+    if (file_p == NULL) {
+        return (-errno);
+    }
+
+    fwrite(BINARY_DUMP_MAGIC, 1, strlen(BINARY_DUMP_MAGIC), file_p);
+    address = (uintptr_t)ml_log_object_binary_dump;
+    fwrite(&address, sizeof(address), 1, file_p);
+    number_of_names = 0;
+
+    for (log_object_p = module.head_p;
+         log_object_p != NULL;
+         log_object_p = log_object_p->next_p) {
+        number_of_names++;
+    }
+
+    fwrite(&number_of_names, sizeof(number_of_names), 1, file_p);
+
+    for (log_object_p = module.head_p;
+         log_object_p != NULL;
+         log_object_p = log_object_p->next_p) {
+        address = (uintptr_t)log_object_p->name_p;
+        length = (uint8_t)strnlen(log_object_p->name_p, BINARY_STRING_SIZE);
+        fwrite(&address, sizeof(address), 1, file_p);
+        fwrite(&length, sizeof(length), 1, file_p);
+        fwrite(log_object_p->name_p, 1, length, file_p);
+    }
+
+    buf_p = binary_copy(&records_size);
+    size = records_size;
+    fwrite(&size, sizeof(size), 1, file_p);
+    fwrite(buf_p, 1, records_size, file_p);
+    free(buf_p);
+    res = 0;
+
+    if (ferror(file_p)) {
+        res = -EIO;
+    }
+
+    if (fclose(file_p) != 0) {
+        res = -errno;
+    }
+
+    return (res);
+}
+
 void ml_log_object_vprint(struct ml_log_object_t *self_p,
                           int level,
                           const char *fmt_p,
                           va_list vlist)
 {
     char buf[512];
-    time_t now;
-    struct tm tm;
+    struct timespec now;
     size_t length;
     ssize_t written;
 
@@ -343,15 +1550,26 @@ void ml_log_object_vprint(struct ml_log_object_t *self_p,
         return;
     }
 
-    now = time(NULL);
-    gmtime_r(&now, &tm);
+    if (atomic_load_explicit(&module.binary.is_started,
+                             memory_order_relaxed)) {
+        binary_vprint(self_p, level, fmt_p, vlist);
 
-    length = strftime(&buf[0], sizeof(buf), "%F %T", &tm);
-    length += snprintf(&buf[length],
-                       sizeof(buf) - length,
-                       " %s %s ",
-                       level_to_string_upper(level),
-                       self_p->name_p);
+        return;
+    }
+
+    if (atomic_load_explicit(&module.async.is_started,
+                             memory_order_relaxed)) {
+        async_vprint(self_p, level, fmt_p, vlist);
+
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    length = format_prefix(&buf[0],
+                           sizeof(buf),
+                           &now,
+                           level,
+                           self_p->name_p);
     length += vsnprintf(&buf[length], sizeof(buf) - length, fmt_p, vlist);
 
     if (length >= sizeof(buf)) {
@@ -375,42 +1593,118 @@ void ml_log_object_print(struct ml_log_object_t *self_p,
     va_end(vlist);
 }
 
+/**
+ * Format one hexdump line, as ml_hexdump() does, including the
+ * newline.
+ */
+static size_t format_hexdump_line(char *line_p,
+                                  const uint8_t *buf_p,
+                                  size_t size,
+                                  size_t offset)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *begin_p;
+    size_t i;
+
+    begin_p = line_p;
+
+    for (i = 0; i < 8; i++) {
+        line_p[i] = hex[(offset >> (28 - 4 * i)) & 0xf];
+    }
+
+    line_p += 8;
+    *line_p++ = ':';
+    *line_p++ = ' ';
+
+    for (i = 0; i < size; i++) {
+        *line_p++ = hex[buf_p[i] >> 4];
+        *line_p++ = hex[buf_p[i] & 0xf];
+        *line_p++ = ' ';
+    }
+
+    memset(line_p, ' ', 3 * (HEXDUMP_LINE_BYTES - size));
+    line_p += 3 * (HEXDUMP_LINE_BYTES - size);
+    *line_p++ = '\'';
+
+    for (i = 0; i < size; i++) {
+        *line_p++ = (isprint(buf_p[i]) ? (char)buf_p[i] : '.');
+    }
+
+    *line_p++ = '\'';
+    *line_p++ = '\n';
+
+    return ((size_t)(line_p - begin_p));
+}
+
+/**
+ * All lines share one prefix and are written with as few system calls
+ * as possible, except in asynchronous and binary mode, where each
+ * line is printed as an entry.
+ */
 void ml_log_object_hexdump(struct ml_log_object_t *self_p,
                            int level,
                            const void *buf_p,
                            size_t size)
 {
-    FILE *file_p;
-    char *formatted_p;
-    size_t formatted_size;
-    char line[128];
+    const uint8_t *u8_buf_p;
+    char lines[HEXDUMP_BATCH_SIZE][HEXDUMP_LINE_SIZE];
+    struct iovec iov[2 * HEXDUMP_BATCH_SIZE];
+    char prefix[96];
+    struct timespec now;
+    size_t offset;
+    size_t length;
+    ssize_t written;
+    int i;
+    bool is_async;
 
     if (level > self_p->level) {
         return;
     }
 
-    file_p = open_memstream(&formatted_p, &formatted_size);
+    u8_buf_p = (const uint8_t *)buf_p;
+    is_async = (atomic_load(&module.binary.is_started)
+                || atomic_load(&module.async.is_started));
 
-    if (file_p == NULL) {
-        return;
-    }
+    length = 0;
 
-    ml_hexdump(buf_p, size, file_p);
-    fclose(file_p);
-
-    file_p = fmemopen(formatted_p, formatted_size, "r");
-
-    if (file_p == NULL) {
-        goto out;
+    if (!is_async) {
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        length = format_prefix(&prefix[0],
+                               sizeof(prefix),
+                               &now,
+                               level,
+                               self_p->name_p);
     }
 
-    while (fgets(&line[0], sizeof(line), file_p) != NULL) {
-        ml_rstrip(&line[0], NULL);
-        ml_log_object_print(self_p, level, "%s", &line[0]);
-    }
-
-    fclose(file_p);
+    offset = 0;
+
+    while (offset < size) {
+        for (i = 0; (i < HEXDUMP_BATCH_SIZE) && (offset < size); i++) {
+            iov[2 * i].iov_base = &prefix[0];
+            iov[2 * i].iov_len = length;
+            iov[2 * i + 1].iov_base = &lines[i][0];
+            iov[2 * i + 1].iov_len = format_hexdump_line(
+                &lines[i][0],
+                &u8_buf_p[offset],
+                MIN(size - offset, HEXDUMP_LINE_BYTES),
+                offset);
+            offset += HEXDUMP_LINE_BYTES;
+
+            if (is_async) {
+                ml_log_object_print(self_p,
+                                    level,
+                                    "%.*s",
+                                    (int)iov[2 * i + 1].iov_len - 1,
+                                    &lines[i][0]);
+            } else if (module.is_kmsg) {
+                written = writev(module.fd, &iov[2 * i], 2);
+                (void)written;
+            }
+        }
 
- out:
-    free(formatted_p);
+        if (!is_async && !module.is_kmsg) {
+            written = writev(module.fd, &iov[0], 2 * i);
+            (void)written;
+        }
+    }
 }
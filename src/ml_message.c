@@ -26,27 +26,272 @@
  * This file is part of the Monolinux C library project.
  */
 
+/*
+ * Small messages are allocated from fixed size classes. Each thread
+ * keeps a free list per size class, and objects are moved between
+ * the thread caches and a shared arena in batches, so the arena mutex
+ * is only taken once per batch. The arena never returns memory to the
+ * system, which keeps steady state allocations away from malloc()
+ * entirely. Messages larger than the largest size class are
+ * allocated with malloc().
+ */
+
 #include <stdlib.h>
 #include "ml/ml.h"
 #include "internal.h"
 
-struct module_t {
+/* Size class of messages allocated with malloc(). */
+#define SIZE_CLASS_NONE                                     -1
+
+/* Size class of messages embedded in other objects. */
+#define SIZE_CLASS_EMBEDDED                                 -2
+
+/* Number of objects moved between a thread cache and the arena. */
+#define BATCH_SIZE                                          32
+
+/* Objects are rounded up to keep messages aligned. */
+#define OBJECT_ALIGNMENT                                    16
+
+#define NUMBER_OF_SIZE_CLASSES                              5
+
+struct free_object_t {
+    struct free_object_t *next_p;
+    /* Only valid in the first object of a batch in the arena. */
+    struct free_object_t *next_batch_p;
+    int length;
+};
+
+struct thread_cache_t {
+    struct {
+        struct free_object_t *head_p;
+        int length;
+    } size_classes[NUMBER_OF_SIZE_CLASSES];
+    bool is_registered;
+};
+
+struct arena_t {
     pthread_mutex_t mutex;
+    struct free_object_t *batches_p;
 };
 
-static struct module_t module;
+struct module_t {
+    pthread_once_t once;
+    pthread_key_t key;
+    struct arena_t arenas[NUMBER_OF_SIZE_CLASSES];
+};
+
+static const size_t size_classes[NUMBER_OF_SIZE_CLASSES] = {
+    0, 16, 64, 256, 1024
+};
+
+static struct module_t module = {
+    .once = PTHREAD_ONCE_INIT,
+    .arenas = {
+        { .mutex = PTHREAD_MUTEX_INITIALIZER, .batches_p = NULL },
+        { .mutex = PTHREAD_MUTEX_INITIALIZER, .batches_p = NULL },
+        { .mutex = PTHREAD_MUTEX_INITIALIZER, .batches_p = NULL },
+        { .mutex = PTHREAD_MUTEX_INITIALIZER, .batches_p = NULL },
+        { .mutex = PTHREAD_MUTEX_INITIALIZER, .batches_p = NULL }
+    }
+};
+
+static __thread struct thread_cache_t thread_cache;
 
-void ml_message_init(void)
+static size_t object_size(int size_class)
 {
-    pthread_mutex_init(&module.mutex, NULL);
+    size_t size;
+
+    size = sizeof(struct ml_message_header_t) + size_classes[size_class];
+
+    return ((size + OBJECT_ALIGNMENT - 1) & ~(size_t)(OBJECT_ALIGNMENT - 1));
+}
+
+static int find_size_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < (int)membersof(size_classes); i++) {
+        if (size <= size_classes[i]) {
+            return (i);
+        }
+    }
+
+    return (SIZE_CLASS_NONE);
+}
+
+static void arena_put(int size_class,
+                      struct free_object_t *batch_p,
+                      int length)
+{
+    struct arena_t *arena_p;
+
+    arena_p = &module.arenas[size_class];
+    batch_p->length = length;
+    pthread_mutex_lock(&arena_p->mutex);
+    batch_p->next_batch_p = arena_p->batches_p;
+    arena_p->batches_p = batch_p;
+    pthread_mutex_unlock(&arena_p->mutex);
+}
+
+static struct free_object_t *arena_get(int size_class, int *length_p)
+{
+    struct arena_t *arena_p;
+    struct free_object_t *batch_p;
+
+    arena_p = &module.arenas[size_class];
+    pthread_mutex_lock(&arena_p->mutex);
+    batch_p = arena_p->batches_p;
+
+    if (batch_p != NULL) {
+        arena_p->batches_p = batch_p->next_batch_p;
+    }
+
+    pthread_mutex_unlock(&arena_p->mutex);
+
+    if (batch_p != NULL) {
+        *length_p = batch_p->length;
+    }
+
+    return (batch_p);
+}
+
+/**
+ * Allocate a new slab with a batch of objects.
+ */
+static struct free_object_t *slab_alloc(int size_class, int *length_p)
+{
+    char *slab_p;
+    struct free_object_t *object_p;
+    size_t size;
+    int i;
+
+    size = object_size(size_class);
+    slab_p = xmalloc(size * BATCH_SIZE);
+
+    for (i = 0; i < BATCH_SIZE - 1; i++) {
+        object_p = (struct free_object_t *)&slab_p[size * i];
+        object_p->next_p = (struct free_object_t *)&slab_p[size * (i + 1)];
+    }
+
+    object_p = (struct free_object_t *)&slab_p[size * (BATCH_SIZE - 1)];
+    object_p->next_p = NULL;
+    *length_p = BATCH_SIZE;
+
+    return ((struct free_object_t *)slab_p);
+}
+
+static void thread_cache_flush(void *arg_p)
+{
+    struct thread_cache_t *cache_p;
+    int i;
+
+    cache_p = (struct thread_cache_t *)arg_p;
+
+    for (i = 0; i < (int)membersof(size_classes); i++) {
+        if (cache_p->size_classes[i].head_p != NULL) {
+            arena_put(i,
+                      cache_p->size_classes[i].head_p,
+                      cache_p->size_classes[i].length);
+            cache_p->size_classes[i].head_p = NULL;
+            cache_p->size_classes[i].length = 0;
+        }
+    }
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&module.key, thread_cache_flush);
+}
+
+/**
+ * Return cached objects to the arena when the thread exits.
+ */
+static void thread_cache_register(void)
+{
+    pthread_once(&module.once, create_key);
+    pthread_setspecific(module.key, &thread_cache);
+    thread_cache.is_registered = true;
+}
+
+static struct ml_message_header_t *object_alloc(int size_class)
+{
+    struct free_object_t *object_p;
+    int length;
+
+    object_p = thread_cache.size_classes[size_class].head_p;
+
+    if (object_p == NULL) {
+        if (!thread_cache.is_registered) {
+            thread_cache_register();
+        }
+
+        object_p = arena_get(size_class, &length);
+
+        if (object_p == NULL) {
+            object_p = slab_alloc(size_class, &length);
+        }
+
+        thread_cache.size_classes[size_class].length = length;
+    }
+
+    thread_cache.size_classes[size_class].head_p = object_p->next_p;
+    thread_cache.size_classes[size_class].length--;
+
+    return ((struct ml_message_header_t *)object_p);
+}
+
+/**
+ * Keep at most two batches per size class in the thread cache, and
+ * move one batch to the arena when there are more.
+ */
+static void object_free(struct ml_message_header_t *header_p)
+{
+    struct free_object_t *object_p;
+    struct free_object_t *last_p;
+    int size_class;
+    int i;
+
+    if (!thread_cache.is_registered) {
+        thread_cache_register();
+    }
+
+    size_class = header_p->size_class;
+    object_p = (struct free_object_t *)header_p;
+    object_p->next_p = thread_cache.size_classes[size_class].head_p;
+    thread_cache.size_classes[size_class].head_p = object_p;
+    thread_cache.size_classes[size_class].length++;
+
+    if (thread_cache.size_classes[size_class].length < 2 * BATCH_SIZE) {
+        return;
+    }
+
+    last_p = object_p;
+
+    for (i = 0; i < BATCH_SIZE - 1; i++) {
+        last_p = last_p->next_p;
+    }
+
+    thread_cache.size_classes[size_class].head_p = last_p->next_p;
+    thread_cache.size_classes[size_class].length -= BATCH_SIZE;
+    last_p->next_p = NULL;
+    arena_put(size_class, object_p, BATCH_SIZE);
 }
 
 void *ml_message_alloc(struct ml_uid_t *uid_p, size_t size)
 {
     struct ml_message_header_t *header_p;
+    int size_class;
+
+    size_class = find_size_class(size);
+
+    if (size_class == SIZE_CLASS_NONE) {
+        header_p = xmalloc(sizeof(*header_p) + size);
+    } else {
+        header_p = object_alloc(size_class);
+    }
 
-    header_p = xmalloc(sizeof(*header_p) + size);
-    header_p->count = 1;
+    atomic_init(&header_p->count, 1);
+    header_p->size_class = size_class;
     header_p->uid_p = uid_p;
     header_p->on_free = NULL;
 
@@ -68,23 +313,43 @@ void ml_message_free(void *message_p)
 
     header_p = message_to_header(message_p);
 
-    pthread_mutex_lock(&module.mutex);
-    header_p->count--;
-    count = header_p->count;
-    pthread_mutex_unlock(&module.mutex);
+    if (header_p->size_class == SIZE_CLASS_EMBEDDED) {
+        return;
+    }
+
+    /* Release this thread's writes to the message, and acquire all
+       other threads' writes before it is freed. */
+    count = atomic_fetch_sub_explicit(&header_p->count,
+                                      1,
+                                      memory_order_release);
+
+    if (count == 1) {
+        atomic_thread_fence(memory_order_acquire);
 
-    if (count == 0) {
         if (header_p->on_free != NULL) {
             header_p->on_free(message_p);
         }
 
-        free(header_p);
+        if (header_p->size_class == SIZE_CLASS_NONE) {
+            free(header_p);
+        } else {
+            object_free(header_p);
+        }
     }
 }
 
 void ml_message_share(void *message_p, int count)
 {
-    pthread_mutex_lock(&module.mutex);
-    message_to_header(message_p)->count += count;
-    pthread_mutex_unlock(&module.mutex);
+    atomic_fetch_add_explicit(&message_to_header(message_p)->count,
+                              count,
+                              memory_order_relaxed);
+}
+
+void ml_message_init_embedded(struct ml_message_header_t *header_p,
+                              struct ml_uid_t *uid_p)
+{
+    atomic_init(&header_p->count, 1);
+    header_p->size_class = SIZE_CLASS_EMBEDDED;
+    header_p->uid_p = uid_p;
+    header_p->on_free = NULL;
 }
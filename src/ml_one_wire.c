@@ -7,7 +7,6 @@
 #include <asm/byteorder.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
-#include <sys/eventfd.h>
 #include "ml/ml.h"
 
 /* Should be part of the toolchain? */
@@ -116,7 +115,6 @@ struct module_t {
     struct ml_log_object_t log_object;
     pthread_t pthread;
     int fd;
-    int put_fd;
     int epoll_fd;
     struct {
         enum ds18b20_state_t state;
@@ -563,9 +561,9 @@ static int init(struct module_t *self_p)
     }
 
     event.events = EPOLLIN;
-    event.data.fd = self_p->put_fd;
+    event.data.fd = ml_queue_get_fd(&self_p->queue);
 
-    res = epoll_ctl(self_p->epoll_fd, EPOLL_CTL_ADD, self_p->put_fd, &event);
+    res = epoll_ctl(self_p->epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event);
 
     if (res == -1) {
         ML_ERROR("epoll_ctl_add");
@@ -583,11 +581,11 @@ static void *one_wire_main(struct module_t *self_p)
 {
     int res;
     struct epoll_event event;
-    uint64_t value;
     void *message_p;
     struct ml_uid_t *uid_p;
 
     pthread_setname_np(self_p->pthread, "ml_one_wire");
+    res = 0;
 
     while (res == 0) {
         res = epoll_wait(self_p->epoll_fd, &event, 1, -1);
@@ -598,23 +596,17 @@ static void *one_wire_main(struct module_t *self_p)
 
         if (event.data.fd == self_p->fd) {
             res = handle_socket(self_p);
-        } else if (event.data.fd == self_p->put_fd) {
-            res = read(self_p->put_fd, &value, sizeof(value));
-
-            if (res != sizeof(value)) {
-                break;
-            }
-
-            uid_p = ml_queue_get(&self_p->queue, &message_p);
-
-            if (uid_p == &ml_one_wire_read_temperature_req) {
-                ds18b20_handle_read_temperature(self_p, message_p);
-            } else if (uid_p == &read_temperature_timout) {
-                ds18b20_handle_read_temperature_timeout(self_p);
+        } else {
+            while ((uid_p = ml_queue_try_get(&self_p->queue,
+                                             &message_p)) != NULL) {
+                if (uid_p == &ml_one_wire_read_temperature_req) {
+                    ds18b20_handle_read_temperature(self_p, message_p);
+                } else if (uid_p == &read_temperature_timout) {
+                    ds18b20_handle_read_temperature_timeout(self_p);
+                }
+
+                ml_message_free(message_p);
             }
-
-            ml_message_free(message_p);
-            res = 0;
         }
     }
 
@@ -663,16 +655,6 @@ static int ds18b20_command(int argc, const char *argv[], FILE *fout_p)
     return (res);
 }
 
-static void on_put_signal_event(int *fd_p)
-{
-    uint64_t value;
-    ssize_t size;
-
-    value = 1;
-    size = write(*fd_p, &value, sizeof(value));
-    (void)size;
-}
-
 void ml_one_wire_init(void)
 {
     module.cn_seqno = 0;
@@ -680,9 +662,6 @@ void ml_one_wire_init(void)
     module.ds18b20.state = ds18b20_state_idle_t;
     module.ds18b20.response_queue_p = NULL;
     ml_queue_init(&module.queue, 32);
-    ml_queue_set_on_put(&module.queue,
-                        (ml_queue_put_t)on_put_signal_event,
-                        &module.put_fd);
     ml_queue_init(&module.read_temperature.response_queue, 2);
     pthread_mutex_init(&module.read_temperature.mutex, NULL);
     ml_timer_init(&module.ds18b20.timer,
@@ -699,17 +678,6 @@ void ml_one_wire_init(void)
 
     if (module.epoll_fd == -1) {
         ml_error("epoll_create1");
-
-        return;
-    }
-
-    /* Put fd. */
-    module.put_fd = eventfd(0, EFD_SEMAPHORE);
-
-    if (module.put_fd == -1) {
-        ml_error("eventfd");
-
-        return;
     }
 }
 
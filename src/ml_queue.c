@@ -26,55 +26,330 @@
  * This file is part of the Monolinux C library project.
  */
 
+/*
+ * Messages are stored in a bounded lock-free ring buffer, ml_ring_t,
+ * based on Dmitry Vyukov's MPMC queue, so producers and consumers
+ * never take a lock. Threads only sleep on a futex when the queue is
+ * full or empty.
+ */
+
+#include <errno.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
 #include "ml/ml.h"
 #include "internal.h"
 
-static bool is_empty(struct ml_queue_t *self_p)
+/* Messages moved per batch, bounding the stack usage of
+   ml_queue_get_many() and ml_queue_put_many(). */
+#define BATCH_LENGTH                                        64
+
+static struct ml_queue_cell_t *cell(struct ml_queue_t *self_p,
+                                     unsigned int pos)
+{
+    return ((struct ml_queue_cell_t *)ml_ring_cell(&self_p->ring, pos));
+}
+
+/**
+ * Make the poll file descriptor readable, unless already done. Only
+ * called if someone polls the queue.
+ */
+static void poll_signal(struct ml_queue_t *self_p, int fd)
 {
-    return (self_p->rdpos == self_p->wrpos);
+    uint64_t value;
+    ssize_t size;
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (!atomic_exchange(&self_p->poll.is_signalled, true)) {
+        value = 1;
+        size = write(fd, &value, sizeof(value));
+        (void)size;
+    }
 }
 
-static bool is_full(struct ml_queue_t *self_p)
+/**
+ * Make the poll file descriptor unreadable. Must be called after
+ * the queue has been observed empty. Signals again if a message was
+ * put meanwhile.
+ */
+static void poll_clear(struct ml_queue_t *self_p, int fd)
 {
-    return (((self_p->wrpos + 1) % self_p->length) == self_p->rdpos);
+    uint64_t value;
+    ssize_t size;
+
+    size = read(fd, &value, sizeof(value));
+    (void)size;
+    atomic_store(&self_p->poll.is_signalled, false);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (!ml_ring_is_empty(&self_p->ring)) {
+        poll_signal(self_p, fd);
+    }
 }
 
-static void push_message(struct ml_queue_t *self_p,
-                         struct ml_message_header_t *header_p)
+static void poll_on_pushed(struct ml_queue_t *self_p)
 {
-    self_p->messages_p[self_p->wrpos] = header_p;
-    self_p->wrpos++;
-    self_p->wrpos %= self_p->length;
+    int fd;
+
+    fd = atomic_load_explicit(&self_p->poll.fd, memory_order_acquire);
+
+    if (fd != -1) {
+        poll_signal(self_p, fd);
+    }
 }
 
-static struct ml_message_header_t *pop_message(struct ml_queue_t *self_p)
+static void poll_on_popped(struct ml_queue_t *self_p)
 {
-    struct ml_message_header_t *header_p;
+    int fd;
+
+    fd = atomic_load_explicit(&self_p->poll.fd, memory_order_acquire);
 
-    header_p = self_p->messages_p[self_p->rdpos];
-    self_p->rdpos++;
-    self_p->rdpos %= self_p->length;
+    if ((fd != -1) && ml_ring_is_empty(&self_p->ring)) {
+        poll_clear(self_p, fd);
+    }
+}
+
+/**
+ * Claim and fill up to given number of free cells with one
+ * compare-and-swap. Returns the number of pushed messages, and the
+ * position of the first one in given position pointer.
+ */
+static int try_push_many(struct ml_queue_t *self_p,
+                         struct ml_message_header_t **headers_pp,
+                         int length,
+                         unsigned int *pos_p)
+{
+    struct ml_queue_cell_t *cell_p;
+    unsigned int pos;
+    int count;
+    int i;
+
+    count = ml_ring_try_claim_write(&self_p->ring, length, &pos);
+
+    for (i = 0; i < count; i++) {
+        cell_p = cell(self_p, pos + i);
+        atomic_store_explicit(&cell_p->header_p,
+                              headers_pp[i],
+                              memory_order_relaxed);
+        atomic_store_explicit(&cell_p->uid_p,
+                              headers_pp[i]->uid_p,
+                              memory_order_relaxed);
+        ml_ring_publish(&self_p->ring, pos + i);
+    }
+
+    *pos_p = pos;
+
+    return (count);
+}
+
+/**
+ * Claim and empty up to given number of filled cells with one
+ * compare-and-swap. Returns the number of popped messages.
+ */
+static int try_pop_many(struct ml_queue_t *self_p,
+                        struct ml_message_header_t **headers_pp,
+                        int length)
+{
+    unsigned int pos;
+    int count;
+    int i;
+
+    count = ml_ring_try_claim_read(&self_p->ring, length, &pos);
 
-    return (header_p);
+    /* Exchange, as the message may be replaced concurrently by
+       ml_queue_try_replace(). */
+    for (i = 0; i < count; i++) {
+        headers_pp[i] = atomic_exchange_explicit(
+            &cell(self_p, pos + i)->header_p,
+            NULL,
+            memory_order_acquire);
+        ml_ring_release(&self_p->ring, pos + i);
+    }
+
+    return (count);
+}
+
+/**
+ * Push up to given number of messages, waiting at most given timeout
+ * in milliseconds for free cells. A negative timeout waits
+ * forever. Returns the number of pushed messages, and the position of
+ * the last partial push in given position pointer.
+ */
+static int push_many(struct ml_queue_t *self_p,
+                     struct ml_message_header_t **headers_pp,
+                     int length,
+                     int timeout,
+                     unsigned int *pos_p)
+{
+    struct timespec deadline;
+    struct timespec *deadline_p;
+    unsigned int sequence;
+    int count;
+    int pushed;
+    int res;
+    int i;
+
+    deadline_p = NULL;
+    count = 0;
+    res = 0;
+
+    while ((count < length) && (res == 0)) {
+        pushed = try_push_many(self_p,
+                               &headers_pp[count],
+                               length - count,
+                               pos_p);
+
+        if (pushed == 0) {
+            if (timeout == 0) {
+                break;
+            }
+
+            if ((timeout > 0) && (deadline_p == NULL)) {
+                deadline_p = ml_make_deadline(&deadline, timeout);
+            }
+
+            sequence = ml_waiters_enter(&self_p->full);
+            pushed = try_push_many(self_p,
+                                   &headers_pp[count],
+                                   length - count,
+                                   pos_p);
+
+            if (pushed == 0) {
+                res = ml_waiters_wait(&self_p->full, sequence, deadline_p);
+            }
+
+            ml_waiters_leave(&self_p->full);
+        }
+
+        /* Wake consumers before waiting for more free cells. */
+        if (pushed > 0) {
+            ml_waiters_signal(&self_p->empty, pushed);
+            poll_on_pushed(self_p);
+
+            if (self_p->on_put.func != NULL) {
+                for (i = 0; i < pushed; i++) {
+                    self_p->on_put.func(self_p->on_put.arg_p);
+                }
+            }
+        }
+
+        count += pushed;
+    }
+
+    return (count);
+}
+
+/**
+ * Pop up to given number of messages, waiting at most given timeout
+ * in milliseconds for at least one message. A negative timeout waits
+ * forever. Returns the number of popped messages.
+ */
+static int pop_many(struct ml_queue_t *self_p,
+                    struct ml_message_header_t **headers_pp,
+                    int length,
+                    int timeout)
+{
+    struct timespec deadline;
+    struct timespec *deadline_p;
+    unsigned int sequence;
+    int count;
+    int res;
+
+    deadline_p = NULL;
+    res = 0;
+
+    while (true) {
+        count = try_pop_many(self_p, headers_pp, length);
+
+        if ((count > 0) || (timeout == 0) || (res != 0)) {
+            break;
+        }
+
+        if ((timeout > 0) && (deadline_p == NULL)) {
+            deadline_p = ml_make_deadline(&deadline, timeout);
+        }
+
+        sequence = ml_waiters_enter(&self_p->empty);
+        count = try_pop_many(self_p, headers_pp, length);
+
+        if (count == 0) {
+            res = ml_waiters_wait(&self_p->empty, sequence, deadline_p);
+        }
+
+        ml_waiters_leave(&self_p->empty);
+
+        if (count > 0) {
+            break;
+        }
+    }
+
+    if (count > 0) {
+        ml_waiters_signal(&self_p->full, count);
+        poll_on_popped(self_p);
+    }
+
+    return (count);
 }
 
 void ml_queue_init(struct ml_queue_t *self_p, int length)
 {
     self_p->on_put.func = NULL;
     self_p->on_put.arg_p = NULL;
-    self_p->rdpos = 0;
-    self_p->wrpos = 0;
-    self_p->length = (length + 1);
-    self_p->messages_p = xmalloc(sizeof(void *) * (length + 1));
-    pthread_mutex_init(&self_p->mutex, NULL);
-    pthread_cond_init(&self_p->full_cond, NULL);
-    pthread_cond_init(&self_p->empty_cond, NULL);
+    ml_ring_init(&self_p->ring, length, sizeof(struct ml_queue_cell_t));
+    ml_waiters_init(&self_p->full);
+    ml_waiters_init(&self_p->empty);
+    atomic_init(&self_p->poll.fd, -1);
+    atomic_init(&self_p->poll.is_signalled, false);
 }
 
 void ml_queue_destroy(struct ml_queue_t *self_p)
 {
-    free(self_p->messages_p);
+    int fd;
+
+    fd = atomic_load(&self_p->poll.fd);
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    ml_ring_destroy(&self_p->ring);
+}
+
+int ml_queue_get_fd(struct ml_queue_t *self_p)
+{
+    int fd;
+    int expected;
+
+    fd = atomic_load(&self_p->poll.fd);
+
+    if (fd != -1) {
+        return (fd);
+    }
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (fd == -1) {
+        return (-1);
+    }
+
+    expected = -1;
+
+    if (!atomic_compare_exchange_strong(&self_p->poll.fd, &expected, fd)) {
+        close(fd);
+
+        return (expected);
+    }
+
+    /* Messages may have been put before the file descriptor
+       existed. */
+    if (!ml_ring_is_empty(&self_p->ring)) {
+        poll_signal(self_p, fd);
+    }
+
+    return (fd);
 }
 
 void ml_queue_set_on_put(struct ml_queue_t *self_p,
@@ -89,36 +364,189 @@ struct ml_uid_t *ml_queue_get(struct ml_queue_t *self_p, void **message_pp)
 {
     struct ml_message_header_t *header_p;
 
-    pthread_mutex_lock(&self_p->mutex);
+    pop_many(self_p, &header_p, 1, -1);
+    *message_pp = message_from_header(header_p);
 
-    /* pthread_cond_signal() unblocks at least one thread. */
-    while (is_empty(self_p)) {
-        pthread_cond_wait(&self_p->empty_cond, &self_p->mutex);
-    }
+    return (header_p->uid_p);
+}
+
+struct ml_uid_t *ml_queue_try_get(struct ml_queue_t *self_p,
+                                  void **message_pp)
+{
+    return (ml_queue_get_timeout(self_p, message_pp, 0));
+}
 
-    header_p = pop_message(self_p);
-    pthread_cond_signal(&self_p->full_cond);
-    pthread_mutex_unlock(&self_p->mutex);
+struct ml_uid_t *ml_queue_get_timeout(struct ml_queue_t *self_p,
+                                      void **message_pp,
+                                      int timeout)
+{
+    struct ml_message_header_t *header_p;
+
+    if (pop_many(self_p, &header_p, 1, timeout) == 0) {
+        return (NULL);
+    }
 
     *message_pp = message_from_header(header_p);
 
     return (header_p->uid_p);
 }
 
+int ml_queue_get_many(struct ml_queue_t *self_p,
+                      struct ml_uid_t **uids_pp,
+                      void **messages_pp,
+                      int length,
+                      int timeout)
+{
+    struct ml_message_header_t *headers[BATCH_LENGTH];
+    int count;
+    int popped;
+    int i;
+
+    if (length <= 0) {
+        return (0);
+    }
+
+    count = 0;
+
+    /* Only wait for the first batch. */
+    do {
+        popped = pop_many(self_p,
+                          &headers[0],
+                          MIN(length - count, BATCH_LENGTH),
+                          count == 0 ? timeout : 0);
+
+        for (i = 0; i < popped; i++) {
+            uids_pp[count + i] = headers[i]->uid_p;
+            messages_pp[count + i] = message_from_header(headers[i]);
+        }
+
+        count += popped;
+    } while ((popped == BATCH_LENGTH) && (count < length));
+
+    return (count);
+}
+
 void ml_queue_put(struct ml_queue_t *self_p, void *message_p)
 {
-    pthread_mutex_lock(&self_p->mutex);
+    struct ml_message_header_t *header_p;
+    unsigned int pos;
+
+    header_p = message_to_header(message_p);
+    push_many(self_p, &header_p, 1, -1, &pos);
+}
+
+int ml_queue_try_put(struct ml_queue_t *self_p, void *message_p)
+{
+    struct ml_message_header_t *header_p;
+    unsigned int pos;
+
+    header_p = message_to_header(message_p);
+
+    if (push_many(self_p, &header_p, 1, 0, &pos) == 0) {
+        return (-EAGAIN);
+    }
+
+    return (0);
+}
+
+int ml_queue_put_timeout(struct ml_queue_t *self_p,
+                         void *message_p,
+                         int timeout)
+{
+    struct ml_message_header_t *header_p;
+    unsigned int pos;
+
+    header_p = message_to_header(message_p);
+
+    if (push_many(self_p, &header_p, 1, timeout, &pos) == 0) {
+        return (-ETIMEDOUT);
+    }
+
+    return (0);
+}
+
+void ml_queue_put_many(struct ml_queue_t *self_p,
+                       void **messages_pp,
+                       int length)
+{
+    struct ml_message_header_t *headers[BATCH_LENGTH];
+    unsigned int pos;
+    int offset;
+    int count;
+    int i;
+
+    for (offset = 0; offset < length; offset += count) {
+        count = MIN(length - offset, BATCH_LENGTH);
+
+        for (i = 0; i < count; i++) {
+            headers[i] = message_to_header(messages_pp[offset + i]);
+        }
 
-    /* pthread_cond_signal() unblocks *at least one* thread. */
-    while (is_full(self_p)) {
-        pthread_cond_wait(&self_p->full_cond, &self_p->mutex);
+        push_many(self_p, &headers[0], count, -1, &pos);
     }
+}
 
-    push_message(self_p, message_to_header(message_p));
-    pthread_cond_signal(&self_p->empty_cond);
-    pthread_mutex_unlock(&self_p->mutex);
+int ml_queue_try_put_position(struct ml_queue_t *self_p,
+                              void *message_p,
+                              unsigned int *position_p)
+{
+    struct ml_message_header_t *header_p;
 
-    if (self_p->on_put.func != NULL) {
-        self_p->on_put.func(self_p->on_put.arg_p);
+    header_p = message_to_header(message_p);
+
+    if (push_many(self_p, &header_p, 1, 0, position_p) == 0) {
+        return (-EAGAIN);
     }
+
+    return (0);
+}
+
+bool ml_queue_try_get_if(struct ml_queue_t *self_p,
+                         struct ml_uid_t *uid_p,
+                         void **message_pp)
+{
+    struct ml_message_header_t *header_p;
+    unsigned int pos;
+
+    if (!ml_ring_peek(&self_p->ring, &pos)) {
+        return (false);
+    }
+
+    /* The message may be taken by another consumer at any time, so
+       only look at the id in the cell. It is valid if the position is
+       still unclaimed below. */
+    if (atomic_load_explicit(&cell(self_p, pos)->uid_p, memory_order_relaxed)
+        != uid_p) {
+        return (false);
+    }
+
+    if (!ml_ring_try_claim_read_at(&self_p->ring, pos)) {
+        return (false);
+    }
+
+    header_p = atomic_exchange_explicit(&cell(self_p, pos)->header_p,
+                                        NULL,
+                                        memory_order_acquire);
+    ml_ring_release(&self_p->ring, pos);
+    ml_waiters_signal(&self_p->full, 1);
+    poll_on_popped(self_p);
+    *message_pp = message_from_header(header_p);
+
+    return (true);
+}
+
+bool ml_queue_try_replace(struct ml_queue_t *self_p,
+                          unsigned int position,
+                          void *old_message_p,
+                          void *new_message_p)
+{
+    struct ml_queue_cell_t *cell_p;
+    struct ml_message_header_t *header_p;
+
+    cell_p = cell(self_p, position);
+    header_p = message_to_header(old_message_p);
+
+    return (atomic_compare_exchange_strong(&cell_p->header_p,
+                                           &header_p,
+                                           message_to_header(new_message_p)));
 }
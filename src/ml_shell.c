@@ -1235,7 +1235,7 @@ static int command_log_print(int argc, const char *argv[])
         return (-EINVAL);
     }
 
-    ml_log_print(level, message_p);
+    ml_log_print(level, "%s", message_p);
 
     return (0);
 }
@@ -1249,6 +1249,22 @@ static int command_log_show(int argc, const char *argv[], FILE *fout_p)
     return (command_dmesg(1, argv, fout_p));
 }
 
+static int command_log_binary(int argc, const char *argv[], FILE *fout_p)
+{
+    int res;
+
+    if (argc == 2) {
+        ml_log_object_binary_render(fout_p);
+        res = 0;
+    } else if (argc == 3) {
+        res = ml_log_object_binary_dump(argv[2]);
+    } else {
+        res = -EINVAL;
+    }
+
+    return (res);
+}
+
 static int command_log(int argc, const char *argv[], FILE *fout_p)
 {
     int res;
@@ -1266,6 +1282,8 @@ static int command_log(int argc, const char *argv[], FILE *fout_p)
             res = command_log_print(argc, argv);
         } else if (strcmp(argv[1], "show") == 0) {
             res = command_log_show(argc, argv, fout_p);
+        } else if (strcmp(argv[1], "binary") == 0) {
+            res = command_log_binary(argc, argv, fout_p);
         }
     }
 
@@ -1276,7 +1294,8 @@ static int command_log(int argc, const char *argv[], FILE *fout_p)
                 "       log set_level <log-object> <mask>\n"
                 "       log store\n"
                 "       log print <message>\n"
-                "       log print <level> <message>\n");
+                "       log print <level> <message>\n"
+                "       log binary [<dump-file>]\n");
     }
 
     return (res);
@@ -29,141 +29,538 @@
  * implementation (MIT).
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
 #include "ml/ml.h"
+#include "internal.h"
 
 #define DIV_CEIL(a, b) (((a) + (b) - 1) / (b))
 
-static void timer_list_insert(struct ml_timer_list_t *self_p,
-                              struct ml_timer_t *timer_p)
+#define SLOTS_MASK (ML_TIMER_WHEEL_SLOTS - 1)
+
+/* One tick is one millisecond. */
+#define TICK_NS                                             1000000ull
+
+#define NO_TICK                                             UINT64_MAX
+
+/* Expiry token state. */
+#define EXPIRY_PENDING                                      1u
+#define EXPIRY_GENERATION_MASK                              (UINT_MAX >> 1)
+
+ML_UID(ml_timer_clock_jump);
+
+/*
+ * Active timers are kept in a hierarchical timing wheel, so starting,
+ * stopping and expiring a timer are all constant time operations.
+ *
+ * Level zero(0) has one slot per tick, level one(1) one slot per 64
+ * ticks, and so on. A timer is put in the lowest level that covers
+ * its expiry tick. Whenever the level zero(0) index wraps, the timers
+ * in the current slot of the next level are moved down to lower
+ * levels, as they are now close enough to be resolved there.
+ *
+ * The handler is tickless. The timer file descriptor is programmed
+ * to expire at the next tick with anything to do, and ticks in
+ * between are skipped. It is disarmed when no timer is active.
+ *
+ * Expired timers are added to a list of pending timers with the
+ * mutex held, and their messages are put on the queues without
+ * waiting. If a queue is full, the timer stays pending, and delivery
+ * is retried every tick. Stopping a timer drops its pending expiries.
+ * A handler waiting for a full queue while holding the mutex would
+ * block consumers that check or stop their timers.
+ *
+ * Ticks are counted on a clock that is never set, so setting the
+ * realtime clock does not affect timers. A realtime timer file
+ * descriptor that is cancelled when the realtime clock is set is
+ * used to detect such clock jumps.
+ */
+
+static void timer_wheel_insert(struct ml_timer_wheel_t *self_p,
+                               struct ml_timer_t *timer_p)
 {
-    struct ml_timer_t *elem_p;
-    struct ml_timer_t *prev_p;
+    struct ml_timer_t **slot_pp;
+    uint64_t expiry_tick;
+    uint64_t delta;
+    int level;
 
-    /* Find element preceeding this timer. */
-    elem_p = self_p->head_p;
-    prev_p = NULL;
+    if (timer_p->expiry_tick < self_p->tick) {
+        timer_p->expiry_tick = self_p->tick;
+    }
+
+    expiry_tick = timer_p->expiry_tick;
+    delta = (expiry_tick - self_p->tick);
+    level = 0;
 
-    /* Find the element to insert this timer before. Delta is
-       initially the timeout. */
-    while (elem_p->delta < timer_p->delta) {
-        timer_p->delta -= elem_p->delta;
-        prev_p = elem_p;
-        elem_p = elem_p->next_p;
+    while ((level < ML_TIMER_WHEEL_LEVELS - 1)
+           && (delta >= (1ull << (ML_TIMER_WHEEL_SLOTS_BITS * (level + 1))))) {
+        level++;
     }
 
-    /* Adjust the next timer for this timers delta. Do not adjust the
-       tail timer. */
-    if (elem_p != &self_p->tail) {
-        elem_p->delta -= timer_p->delta;
+    slot_pp = &self_p->slots[level][(expiry_tick
+                                     >> (ML_TIMER_WHEEL_SLOTS_BITS * level))
+                                    & SLOTS_MASK];
+    timer_p->next_p = *slot_pp;
+
+    if (timer_p->next_p != NULL) {
+        timer_p->next_p->prev_pp = &timer_p->next_p;
     }
 
-    /* Insert the new timer into list. */
-    timer_p->next_p = elem_p;
+    timer_p->prev_pp = slot_pp;
+    *slot_pp = timer_p;
+}
 
-    if (prev_p == NULL) {
-        self_p->head_p = timer_p;
-    } else {
-        prev_p->next_p = timer_p;
+/**
+ * Remove given timer from its wheel, if active.
+ */
+static void timer_wheel_remove(struct ml_timer_t *timer_p)
+{
+    if (timer_p->prev_pp == NULL) {
+        return;
+    }
+
+    *timer_p->prev_pp = timer_p->next_p;
+
+    if (timer_p->next_p != NULL) {
+        timer_p->next_p->prev_pp = timer_p->prev_pp;
+    }
+
+    timer_p->prev_pp = NULL;
+}
+
+/**
+ * Remove all timers from given slot and return them as a list.
+ */
+static struct ml_timer_t *timer_wheel_take(struct ml_timer_t **slot_pp)
+{
+    struct ml_timer_t *timer_p;
+
+    timer_p = *slot_pp;
+    *slot_pp = NULL;
+
+    return (timer_p);
+}
+
+/**
+ * Move timers in the current slot of given level to lower levels.
+ * Returns the slot index.
+ */
+static int timer_wheel_cascade(struct ml_timer_wheel_t *self_p, int level)
+{
+    struct ml_timer_t *timer_p;
+    struct ml_timer_t *next_p;
+    int index;
+
+    index = ((self_p->tick >> (ML_TIMER_WHEEL_SLOTS_BITS * level))
+             & SLOTS_MASK);
+    timer_p = timer_wheel_take(&self_p->slots[level][index]);
+
+    while (timer_p != NULL) {
+        next_p = timer_p->next_p;
+        timer_wheel_insert(self_p, timer_p);
+        timer_p = next_p;
     }
+
+    return (index);
 }
 
 /**
- * Remove given timer from given list of active timers.
+ * Returns the tick when the next timer expires or timers are moved
+ * to lower levels, or NO_TICK if no timer is active.
  */
-static void timer_list_remove(struct ml_timer_list_t *self_p,
-                              struct ml_timer_t *timer_p)
-{
-    struct ml_timer_t *elem_p;
-    struct ml_timer_t *prev_p;
-
-    /* Find element preceeding this timer.*/
-    elem_p = self_p->head_p;
-    prev_p = NULL;
-
-    while (elem_p != NULL) {
-        if (elem_p == timer_p) {
-            /* Remove the timer from the list. */
-            if (prev_p != NULL) {
-                prev_p->next_p = elem_p->next_p;
-            } else {
-                self_p->head_p = elem_p->next_p;
+static uint64_t timer_wheel_next_tick(struct ml_timer_wheel_t *self_p)
+{
+    uint64_t next_tick;
+    uint64_t tick;
+    uint64_t unit;
+    uint64_t period;
+    int level;
+    int index;
+
+    next_tick = NO_TICK;
+
+    for (level = 0; level < ML_TIMER_WHEEL_LEVELS; level++) {
+        unit = (1ull << (ML_TIMER_WHEEL_SLOTS_BITS * level));
+        period = (unit << ML_TIMER_WHEEL_SLOTS_BITS);
+
+        for (index = 0; index < ML_TIMER_WHEEL_SLOTS; index++) {
+            if (self_p->slots[level][index] == NULL) {
+                continue;
             }
 
-            /* Add the delta timeout to the next timer. */
-            if (elem_p->next_p != &self_p->tail) {
-                elem_p->next_p->delta += elem_p->delta;
+            tick = ((self_p->tick & ~(period - 1)) + (uint64_t)index * unit);
+
+            if (tick < self_p->tick) {
+                tick += period;
             }
 
-            return;
+            if (tick < next_tick) {
+                next_tick = tick;
+            }
         }
+    }
+
+    return (next_tick);
+}
 
-        prev_p = elem_p;
-        elem_p = elem_p->next_p;
+static void pending_append(struct ml_timer_handler_t *self_p,
+                           struct ml_timer_t *timer_p)
+{
+    timer_p->pending.count++;
+
+    if (timer_p->pending.prev_pp != NULL) {
+        return;
     }
+
+    timer_p->pending.next_p = NULL;
+    timer_p->pending.prev_pp = self_p->pending.tail_pp;
+    *self_p->pending.tail_pp = timer_p;
+    self_p->pending.tail_pp = &timer_p->pending.next_p;
 }
 
-static void tick(struct ml_timer_handler_t *self_p)
+static void pending_remove(struct ml_timer_handler_t *self_p,
+                           struct ml_timer_t *timer_p)
+{
+    timer_p->pending.count = 0;
+
+    if (timer_p->pending.prev_pp == NULL) {
+        return;
+    }
+
+    *timer_p->pending.prev_pp = timer_p->pending.next_p;
+
+    if (timer_p->pending.next_p != NULL) {
+        timer_p->pending.next_p->pending.prev_pp = timer_p->pending.prev_pp;
+    } else {
+        self_p->pending.tail_pp = timer_p->pending.prev_pp;
+    }
+
+    timer_p->pending.prev_pp = NULL;
+}
+
+/**
+ * Put the embedded expiry token on the queue, unless already there.
+ * Then the receiver takes the token later and sees the latest
+ * generation. Returns false if the queue is full.
+ */
+static bool timer_deliver_embedded(struct ml_timer_t *timer_p)
+{
+    unsigned int state;
+    unsigned int old_state;
+
+    state = ((atomic_load_explicit(&timer_p->generation,
+                                   memory_order_relaxed) << 1)
+             | EXPIRY_PENDING);
+    old_state = atomic_exchange(&timer_p->token.expiry.state, state);
+
+    if ((old_state & EXPIRY_PENDING) != 0) {
+        return (true);
+    }
+
+    if (ml_queue_try_put(timer_p->queue_p,
+                         message_from_header(&timer_p->token.header)) != 0) {
+        /* Not in the queue, so nobody else changes the state. */
+        atomic_store(&timer_p->token.expiry.state, old_state);
+
+        return (false);
+    }
+
+    return (true);
+}
+
+/**
+ * Put pending expiries of given timer on its queue. Returns false if
+ * the queue is full.
+ */
+static bool timer_deliver(struct ml_timer_t *timer_p)
+{
+    void *message_p;
+
+    if (timer_p->is_embedded) {
+        if (!timer_deliver_embedded(timer_p)) {
+            return (false);
+        }
+
+        timer_p->pending.count = 0;
+
+        return (true);
+    }
+
+    while (timer_p->pending.count > 0) {
+        message_p = ml_message_alloc(timer_p->message_p, 0);
+
+        if (ml_queue_try_put(timer_p->queue_p, message_p) != 0) {
+            ml_message_free(message_p);
+
+            return (false);
+        }
+
+        timer_p->number_of_outstanding_timeouts++;
+        timer_p->pending.count--;
+    }
+
+    return (true);
+}
+
+/**
+ * Put pending expiries on their queues, without waiting. Called with
+ * the mutex held.
+ */
+static void handler_deliver(struct ml_timer_handler_t *self_p)
 {
     struct ml_timer_t *timer_p;
-    struct ml_timer_list_t *list_p;
+    struct ml_timer_t *next_p;
 
-    pthread_mutex_lock(&self_p->mutex);
-    list_p = &self_p->timers;
-
-    /* Return if no timers are active.*/
-    if (list_p->head_p != &list_p->tail) {
-        /* Fire all expired timers.*/
-        list_p->head_p->delta--;
-
-        while (list_p->head_p->delta == 0) {
-            timer_p = list_p->head_p;
-            list_p->head_p = timer_p->next_p;
-            timer_p->number_of_outstanding_timeouts++;
-            ml_queue_put(timer_p->queue_p,
-                         ml_message_alloc(timer_p->message_p, 0));
-
-            /* Re-set periodic timers. */
-            if (timer_p->repeat_ticks > 0) {
-                timer_p->delta = timer_p->repeat_ticks;
-                timer_list_insert(list_p, timer_p);
+    timer_p = self_p->pending.head_p;
+
+    while (timer_p != NULL) {
+        next_p = timer_p->pending.next_p;
+
+        if (timer_deliver(timer_p)) {
+            pending_remove(self_p, timer_p);
+        }
+
+        timer_p = next_p;
+    }
+}
+
+static void timer_wheel_process_tick(struct ml_timer_handler_t *handler_p,
+                                     uint64_t now_tick)
+{
+    struct ml_timer_wheel_t *self_p;
+    struct ml_timer_t *timer_p;
+    struct ml_timer_t *next_p;
+    int level;
+
+    self_p = &handler_p->wheel;
+
+    if ((self_p->tick & SLOTS_MASK) == 0) {
+        level = 1;
+
+        while ((level < ML_TIMER_WHEEL_LEVELS)
+               && (timer_wheel_cascade(self_p, level) == 0)) {
+            level++;
+        }
+    }
+
+    /* Fire all expired timers. */
+    timer_p = timer_wheel_take(&self_p->slots[0][self_p->tick & SLOTS_MASK]);
+
+    while (timer_p != NULL) {
+        next_p = timer_p->next_p;
+        timer_p->prev_pp = NULL;
+        pending_append(handler_p, timer_p);
+
+        /* Re-set periodic timers. Skip missed periods instead of
+           expiring repeatedly if late. */
+        if (timer_p->repeat_ticks > 0) {
+            timer_p->expiry_tick += timer_p->repeat_ticks;
+
+            if (timer_p->expiry_tick < now_tick) {
+                timer_p->expiry_tick = (now_tick + timer_p->repeat_ticks);
             }
+
+            timer_wheel_insert(self_p, timer_p);
         }
+
+        timer_p = next_p;
     }
 
-    pthread_mutex_unlock(&self_p->mutex);
+    self_p->tick++;
 }
 
-static void *handler_main(struct ml_timer_handler_t *handler_p)
+/**
+ * Process all ticks up to and including given tick. Ticks without
+ * anything to do are skipped.
+ */
+static void timer_wheel_advance(struct ml_timer_handler_t *handler_p,
+                                uint64_t now_tick)
+{
+    struct ml_timer_wheel_t *self_p;
+    uint64_t next_tick;
+
+    self_p = &handler_p->wheel;
+
+    while (true) {
+        next_tick = timer_wheel_next_tick(self_p);
+
+        if (next_tick > now_tick) {
+            break;
+        }
+
+        self_p->tick = next_tick;
+        timer_wheel_process_tick(handler_p, now_tick);
+    }
+
+    if (self_p->tick <= now_tick) {
+        self_p->tick = (now_tick + 1);
+    }
+}
+
+static uint64_t now_ns(clockid_t clock_id)
+{
+    struct timespec now;
+
+    clock_gettime(clock_id, &now);
+
+    return ((uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec);
+}
+
+static uint64_t handler_elapsed_ns(struct ml_timer_handler_t *self_p)
+{
+    return (now_ns(self_p->clock_id) - self_p->start_time);
+}
+
+/**
+ * Program the timer file descriptor to expire at the next tick with
+ * anything to do, or disarm it if no timer is active.
+ */
+static void handler_arm(struct ml_timer_handler_t *self_p)
 {
     struct itimerspec timeout;
+    uint64_t next_tick;
+    uint64_t expiry_time;
+
+    next_tick = timer_wheel_next_tick(&self_p->wheel);
+
+    if (next_tick == self_p->armed_tick) {
+        return;
+    }
+
+    self_p->armed_tick = next_tick;
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0;
+
+    if (next_tick == NO_TICK) {
+        timeout.it_value.tv_sec = 0;
+        timeout.it_value.tv_nsec = 0;
+    } else {
+        expiry_time = (self_p->start_time + next_tick * TICK_NS);
+        timeout.it_value.tv_sec = (time_t)(expiry_time / 1000000000ull);
+        timeout.it_value.tv_nsec = (long)(expiry_time % 1000000000ull);
+    }
+
+    timerfd_settime(self_p->fd, TFD_TIMER_ABSTIME, &timeout, NULL);
+}
+
+/**
+ * Arm given realtime timer file descriptor to be cancelled when the
+ * realtime clock is set.
+ */
+static void clock_jump_arm(int fd)
+{
+    struct itimerspec timeout;
+
+    timeout.it_value.tv_sec = LONG_MAX;
+    timeout.it_value.tv_nsec = 0;
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0;
+    timerfd_settime(fd,
+                    TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                    &timeout,
+                    NULL);
+}
+
+static void handle_timeout(struct ml_timer_handler_t *self_p)
+{
     uint64_t value;
-    ssize_t res;
 
-    pthread_setname_np(pthread_self(), "ml_timer_hndlr");
+    if (read(self_p->fd, &value, sizeof(value)) != sizeof(value)) {
+        return;
+    }
+
+    pthread_mutex_lock(&self_p->mutex);
+    timer_wheel_advance(self_p, handler_elapsed_ns(self_p) / TICK_NS);
+    handler_deliver(self_p);
+    handler_arm(self_p);
+    pthread_mutex_unlock(&self_p->mutex);
+}
+
+/**
+ * Retry putting pending expiries on full queues.
+ */
+static void handle_pending(struct ml_timer_handler_t *self_p)
+{
+    pthread_mutex_lock(&self_p->mutex);
+    handler_deliver(self_p);
+    pthread_mutex_unlock(&self_p->mutex);
+}
+
+/**
+ * Returns the poll timeout in milliseconds. Pending expiries are
+ * retried every tick.
+ */
+static int handler_poll_timeout(struct ml_timer_handler_t *self_p)
+{
+    int timeout;
+
+    pthread_mutex_lock(&self_p->mutex);
+    timeout = (self_p->pending.head_p != NULL ? 1 : -1);
+    pthread_mutex_unlock(&self_p->mutex);
 
-    handler_p->fd = timerfd_create(CLOCK_REALTIME, 0);
+    return (timeout);
+}
 
-    if (handler_p->fd == -1) {
-        return (NULL);
+/**
+ * Reading fails with ECANCELED once the realtime clock has been set.
+ */
+static void handle_clock_jump(struct ml_timer_handler_t *self_p)
+{
+    uint64_t value;
+
+    if (read(self_p->clock_jump_fd, &value, sizeof(value)) != -1) {
+        return;
     }
 
-    timeout.it_value.tv_sec = 0;
-    timeout.it_value.tv_nsec = 100000000;
-    timeout.it_interval.tv_sec= 0;
-    timeout.it_interval.tv_nsec = 100000000;
-    timerfd_settime(handler_p->fd, 0, &timeout, NULL);
+    if (errno != ECANCELED) {
+        return;
+    }
+
+    clock_jump_arm(self_p->clock_jump_fd);
+    ml_bus_broadcast(self_p->bus_p, ml_message_alloc(&ml_timer_clock_jump, 0));
+}
+
+static void *handler_main(struct ml_timer_handler_t *handler_p)
+{
+    struct pollfd fds[2];
+    nfds_t number_of_fds;
+    int res;
+
+    pthread_setname_np(pthread_self(), "ml_timer_hndlr");
+
+    fds[0].fd = handler_p->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = handler_p->clock_jump_fd;
+    fds[1].events = POLLIN;
+    number_of_fds = (handler_p->clock_jump_fd != -1 ? 2 : 1);
 
     while (true) {
-        res = read(handler_p->fd, &value, sizeof(value));
+        res = poll(&fds[0], number_of_fds, handler_poll_timeout(handler_p));
+
+        if (res == 0) {
+            handle_pending(handler_p);
+
+            continue;
+        }
+
+        if (res == -1) {
+            if (errno != EINTR) {
+                sleep(1);
+            }
 
-        if (res != sizeof(value)) {
-            sleep(1);
             continue;
         }
 
-        tick(handler_p);
+        if (fds[0].revents & POLLIN) {
+            handle_timeout(handler_p);
+        }
+
+        if ((number_of_fds == 2) && (fds[1].revents & POLLIN)) {
+            handle_clock_jump(handler_p);
+        }
     }
 
     return (NULL);
@@ -171,11 +568,46 @@ static void *handler_main(struct ml_timer_handler_t *handler_p)
 
 void ml_timer_handler_init(struct ml_timer_handler_t *self_p)
 {
-    self_p->timers.head_p = &self_p->timers.tail;
-    self_p->timers.tail.next_p = NULL;
-    self_p->timers.tail.delta = -1;
+    ml_timer_handler_init_clock(self_p, CLOCK_MONOTONIC, NULL);
+}
+
+void ml_timer_handler_init_clock(struct ml_timer_handler_t *self_p,
+                                 clockid_t clock_id,
+                                 struct ml_bus_t *bus_p)
+{
+    int level;
+    int index;
+
+    self_p->wheel.tick = 0;
+
+    for (level = 0; level < ML_TIMER_WHEEL_LEVELS; level++) {
+        for (index = 0; index < ML_TIMER_WHEEL_SLOTS; index++) {
+            self_p->wheel.slots[level][index] = NULL;
+        }
+    }
 
+    self_p->clock_id = clock_id;
+    self_p->start_time = now_ns(clock_id);
+    self_p->armed_tick = NO_TICK;
+    self_p->bus_p = bus_p;
+    self_p->clock_jump_fd = -1;
+    self_p->pending.head_p = NULL;
+    self_p->pending.tail_pp = &self_p->pending.head_p;
     pthread_mutex_init(&self_p->mutex, NULL);
+    self_p->fd = timerfd_create(clock_id, 0);
+
+    if (self_p->fd == -1) {
+        return;
+    }
+
+    if (bus_p != NULL) {
+        self_p->clock_jump_fd = timerfd_create(CLOCK_REALTIME, 0);
+
+        if (self_p->clock_jump_fd != -1) {
+            clock_jump_arm(self_p->clock_jump_fd);
+        }
+    }
+
     pthread_create(&self_p->pthread,
                    NULL,
                    (void *(*)(void *))handler_main,
@@ -192,33 +624,63 @@ void ml_timer_handler_timer_init(struct ml_timer_handler_t *self_p,
     timer_p->queue_p = queue_p;
     timer_p->number_of_outstanding_timeouts = 0;
     timer_p->number_of_timeouts_to_ignore = 0;
+    timer_p->next_p = NULL;
+    timer_p->prev_pp = NULL;
+    timer_p->pending.count = 0;
+    timer_p->pending.next_p = NULL;
+    timer_p->pending.prev_pp = NULL;
+    timer_p->is_embedded = false;
+    atomic_init(&timer_p->generation, 0);
+}
+
+void ml_timer_handler_timer_init_embedded(struct ml_timer_handler_t *self_p,
+                                          struct ml_timer_t *timer_p,
+                                          struct ml_uid_t *message_p,
+                                          struct ml_queue_t *queue_p)
+{
+    ml_timer_handler_timer_init(self_p, timer_p, message_p, queue_p);
+    timer_p->is_embedded = true;
+    ml_message_init_embedded(&timer_p->token.header, message_p);
+    timer_p->token.expiry.timer_p = timer_p;
+    atomic_init(&timer_p->token.expiry.state, 0);
 }
 
 void ml_timer_handler_timer_start(struct ml_timer_t *self_p,
                                   unsigned int initial,
                                   unsigned int repeat)
 {
+    struct ml_timer_handler_t *handler_p;
+
     ml_timer_stop(self_p);
 
-    self_p->initial_ticks = DIV_CEIL(initial, 100);
-    self_p->repeat_ticks = DIV_CEIL(repeat, 100);
-    self_p->delta = self_p->initial_ticks;
+    handler_p = self_p->handler_p;
+    self_p->initial_ticks = initial;
+    self_p->repeat_ticks = repeat;
 
-    /* Must wait at least two ticks to ensure the timer does not
-       expire early since it may be started close to the next tick
-       occurs. */
-    self_p->delta++;
+    pthread_mutex_lock(&handler_p->mutex);
 
-    pthread_mutex_lock(&self_p->handler_p->mutex);
-    timer_list_insert(&self_p->handler_p->timers, self_p);
-    pthread_mutex_unlock(&self_p->handler_p->mutex);
+    /* Round up to not expire early. */
+    self_p->expiry_tick = (DIV_CEIL(handler_elapsed_ns(handler_p), TICK_NS)
+                           + self_p->initial_ticks);
+    timer_wheel_insert(&handler_p->wheel, self_p);
+
+    if (self_p->expiry_tick < handler_p->armed_tick) {
+        handler_arm(handler_p);
+    }
+
+    pthread_mutex_unlock(&handler_p->mutex);
 }
 
 void ml_timer_handler_timer_stop(struct ml_timer_t *self_p)
 {
     pthread_mutex_lock(&self_p->handler_p->mutex);
     self_p->number_of_timeouts_to_ignore = self_p->number_of_outstanding_timeouts;
-    timer_list_remove(&self_p->handler_p->timers, self_p);
+    atomic_store_explicit(&self_p->generation,
+                          atomic_load_explicit(&self_p->generation,
+                                               memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    timer_wheel_remove(self_p);
+    pending_remove(self_p->handler_p, self_p);
     pthread_mutex_unlock(&self_p->handler_p->mutex);
 }
 
@@ -240,3 +702,17 @@ bool ml_timer_is_message_valid(struct ml_timer_t *self_p)
 
     return (is_valid);
 }
+
+bool ml_timer_take_expiry(void *message_p)
+{
+    struct ml_timer_expiry_t *expiry_p;
+    unsigned int state;
+    unsigned int generation;
+
+    expiry_p = (struct ml_timer_expiry_t *)message_p;
+    state = atomic_exchange(&expiry_p->state, 0);
+    generation = atomic_load_explicit(&expiry_p->timer_p->generation,
+                                      memory_order_relaxed);
+
+    return ((state >> 1) == (generation & EXPIRY_GENERATION_MASK));
+}
@@ -26,54 +26,1424 @@
  * This file is part of the Monolinux C library project.
  */
 
+/*
+ * Each worker has a Chase-Lev deque of jobs. Jobs spawned by a worker
+ * are pushed to the bottom of its own deque, and taken from the
+ * bottom by the same worker, while idle workers steal from the top of
+ * other workers' deques. Jobs spawned by other threads, by workers
+ * with full deques, and jobs in lower priority lanes go to the lane's
+ * shared ring, a lock-free ring buffer, ml_ring_t, of entry and
+ * argument slots. Workers pick lanes in strict priority order, or by
+ * weighted round robin. Caller allocated jobs that do not fit in the
+ * highest priority ring are linked into the overflow list instead of
+ * waiting. Workers with nothing to do sleep until a job is spawned.
+ *
+ * Spawning never allocates memory.
+ *
+ * A future is a caller allocated job that stores the result of its
+ * entry function and wakes up threads waiting for it. Workers waiting
+ * for a future run other jobs meanwhile.
+ *
+ * Parallel for and reduce split a range into chunks that are claimed
+ * with compare-and-swap by the calling thread and by helper jobs in
+ * the pool. Chunks get smaller as the remaining range shrinks, which
+ * balances the load with few claims. The shared context is reference
+ * counted, as helper jobs may start after the range is done.
+ *
+ * An elastic pool starts and stops workers at runtime. Worker slots
+ * are allocated for the maximum number of workers up front, and a
+ * stopped worker leaves an empty deque behind, so thieves may scan
+ * all slots without synchronizing with starting and stopping workers.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include "ml/ml.h"
+#include "internal.h"
 
-struct worker_pool_job_message_t {
-    ml_worker_pool_job_entry_t entry;
-    void *arg_p;
+#define DEQUE_SIZE                                          256
+
+/* Future states. */
+#define FUTURE_STATE_PENDING                                0
+#define FUTURE_STATE_PENDING_WITH_WAITERS                   1
+#define FUTURE_STATE_DONE                                   2
+
+/* Marks a completed future in its continuation pointer. */
+#define FUTURE_COMPLETED ((struct ml_worker_pool_future_t *)1)
+
+struct job_t {
+    _Atomic(ml_worker_pool_job_entry_t) entry;
+    void *_Atomic arg_p;
+    _Atomic uint64_t spawn_time;
+};
+
+struct deque_t {
+    atomic_ulong top;
+    char padding[ML_CACHE_LINE_SIZE];
+    atomic_ulong bottom;
+    struct job_t jobs[DEQUE_SIZE];
 };
 
-static ML_UID(worker_pool_job_mid);
+struct ml_worker_pool_worker_t {
+    struct ml_worker_pool_t *pool_p;
+    int index;
+    /* Weighted lane scheduling state. */
+    int lane;
+    int credits;
+    /* Pinned CPU, or -1. */
+    int cpu;
+    /* Protected by the pool mutex. */
+    bool is_running;
+    bool has_pthread;
+    char padding[ML_CACHE_LINE_SIZE];
+    struct deque_t deque;
+};
+
+enum steal_result_t {
+    steal_result_ok_t = 0,
+    steal_result_empty_t,
+    steal_result_retry_t
+};
+
+/* The worker running in this thread, if any. */
+static __thread struct ml_worker_pool_worker_t *current_worker_p = NULL;
+
+static void deque_init(struct deque_t *self_p)
+{
+    atomic_init(&self_p->top, 0);
+    atomic_init(&self_p->bottom, 0);
+}
+
+static void job_write(struct job_t *self_p,
+                      ml_worker_pool_job_entry_t entry,
+                      void *arg_p,
+                      uint64_t spawn_time)
+{
+    atomic_store_explicit(&self_p->entry, entry, memory_order_relaxed);
+    atomic_store_explicit(&self_p->arg_p, arg_p, memory_order_relaxed);
+    atomic_store_explicit(&self_p->spawn_time,
+                          spawn_time,
+                          memory_order_relaxed);
+}
+
+static void job_read(struct job_t *self_p,
+                     ml_worker_pool_job_entry_t *entry_p,
+                     void **arg_pp,
+                     uint64_t *spawn_time_p)
+{
+    *entry_p = atomic_load_explicit(&self_p->entry, memory_order_relaxed);
+    *arg_pp = atomic_load_explicit(&self_p->arg_p, memory_order_relaxed);
+    *spawn_time_p = atomic_load_explicit(&self_p->spawn_time,
+                                         memory_order_relaxed);
+}
+
+/**
+ * Push a job to the bottom. Only called by the owner. Returns false
+ * if the deque is full.
+ */
+static bool deque_push(struct deque_t *self_p,
+                       ml_worker_pool_job_entry_t entry,
+                       void *arg_p,
+                       uint64_t spawn_time)
+{
+    unsigned long bottom;
+    unsigned long top;
+
+    bottom = atomic_load_explicit(&self_p->bottom, memory_order_relaxed);
+    top = atomic_load_explicit(&self_p->top, memory_order_acquire);
+
+    if ((long)(bottom - top) >= DEQUE_SIZE) {
+        return (false);
+    }
+
+    job_write(&self_p->jobs[bottom % DEQUE_SIZE], entry, arg_p, spawn_time);
+    atomic_store_explicit(&self_p->bottom, bottom + 1, memory_order_release);
+
+    return (true);
+}
+
+/**
+ * Take a job from the bottom. Only called by the owner. Returns false
+ * if the deque is empty.
+ */
+static bool deque_take(struct deque_t *self_p,
+                       ml_worker_pool_job_entry_t *entry_p,
+                       void **arg_pp,
+                       uint64_t *spawn_time_p)
+{
+    unsigned long bottom;
+    unsigned long top;
+    bool res;
+
+    bottom = atomic_load_explicit(&self_p->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&self_p->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&self_p->top, memory_order_relaxed);
+
+    if ((long)(bottom - top) < 0) {
+        atomic_store_explicit(&self_p->bottom,
+                              bottom + 1,
+                              memory_order_relaxed);
+
+        return (false);
+    }
+
+    job_read(&self_p->jobs[bottom % DEQUE_SIZE],
+             entry_p,
+             arg_pp,
+             spawn_time_p);
+
+    if (bottom != top) {
+        return (true);
+    }
+
+    /* Last job, race with thieves. */
+    res = atomic_compare_exchange_strong_explicit(&self_p->top,
+                                                  &top,
+                                                  top + 1,
+                                                  memory_order_seq_cst,
+                                                  memory_order_relaxed);
+    atomic_store_explicit(&self_p->bottom, bottom + 1, memory_order_relaxed);
+
+    return (res);
+}
+
+/**
+ * Steal a job from the top. Called by any thread.
+ */
+static enum steal_result_t deque_steal(struct deque_t *self_p,
+                                       ml_worker_pool_job_entry_t *entry_p,
+                                       void **arg_pp,
+                                       uint64_t *spawn_time_p)
+{
+    unsigned long bottom;
+    unsigned long top;
+
+    top = atomic_load_explicit(&self_p->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&self_p->bottom, memory_order_acquire);
+
+    if ((long)(bottom - top) <= 0) {
+        return (steal_result_empty_t);
+    }
+
+    /* The slot cannot be overwritten before top is moved past it. */
+    job_read(&self_p->jobs[top % DEQUE_SIZE], entry_p, arg_pp, spawn_time_p);
+
+    if (!atomic_compare_exchange_strong_explicit(&self_p->top,
+                                                 &top,
+                                                 top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return (steal_result_retry_t);
+    }
+
+    return (steal_result_ok_t);
+}
+
+/**
+ * Number of jobs in given deque. Called by any thread, so the result
+ * is only a snapshot.
+ */
+static unsigned int deque_get_length(struct deque_t *self_p)
+{
+    unsigned long top;
+    unsigned long bottom;
+
+    top = atomic_load_explicit(&self_p->top, memory_order_relaxed);
+    bottom = atomic_load_explicit(&self_p->bottom, memory_order_relaxed);
+
+    if ((long)(bottom - top) <= 0) {
+        return (0);
+    }
+
+    return ((unsigned int)(bottom - top));
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec);
+}
+
+/**
+ * Spawn time of a new job, or zero(0) if lane statistics are
+ * disabled, which is the common case, as reading the clock for every
+ * job is not free.
+ */
+static uint64_t make_spawn_time(struct ml_worker_pool_t *self_p)
+{
+    if (!atomic_load_explicit(&self_p->is_lane_statistics_enabled,
+                              memory_order_relaxed)) {
+        return (0);
+    }
+
+    return (now_ns());
+}
+
+static void lane_init(struct ml_worker_pool_lane_t *self_p,
+                      int length,
+                      int weight)
+{
+    ml_ring_init(&self_p->ring, length, sizeof(struct ml_worker_pool_slot_t));
+    self_p->weight = weight;
+    ml_waiters_init(&self_p->full);
+    atomic_init(&self_p->statistics.number_of_jobs, 0);
+    atomic_init(&self_p->statistics.total_wait_time, 0);
+    atomic_init(&self_p->statistics.max_wait_time, 0);
+}
+
+/**
+ * Put given job in given lane. Returns false if full.
+ */
+static bool lane_try_put(struct ml_worker_pool_lane_t *self_p,
+                         ml_worker_pool_job_entry_t entry,
+                         void *arg_p,
+                         uint64_t spawn_time)
+{
+    struct ml_worker_pool_slot_t *slot_p;
+    unsigned int pos;
+
+    if (ml_ring_try_claim_write(&self_p->ring, 1, &pos) == 0) {
+        return (false);
+    }
+
+    slot_p = ml_ring_cell(&self_p->ring, pos);
+    slot_p->entry = entry;
+    slot_p->arg_p = arg_p;
+    slot_p->spawn_time = spawn_time;
+    ml_ring_publish(&self_p->ring, pos);
+
+    return (true);
+}
+
+/**
+ * Account for a job taken from given lane. Jobs spawned with
+ * statistics disabled have no spawn time and are not counted.
+ */
+static void lane_update_statistics(struct ml_worker_pool_lane_t *self_p,
+                                   uint64_t spawn_time)
+{
+    uint64_t wait_time;
+    unsigned long long max_wait_time;
+
+    if (spawn_time == 0) {
+        return;
+    }
+
+    wait_time = (now_ns() - spawn_time);
+    atomic_fetch_add_explicit(&self_p->statistics.number_of_jobs,
+                              1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&self_p->statistics.total_wait_time,
+                              wait_time,
+                              memory_order_relaxed);
+    max_wait_time = atomic_load_explicit(&self_p->statistics.max_wait_time,
+                                         memory_order_relaxed);
+
+    while (wait_time > max_wait_time) {
+        if (atomic_compare_exchange_weak_explicit(
+                &self_p->statistics.max_wait_time,
+                &max_wait_time,
+                wait_time,
+                memory_order_relaxed,
+                memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+/**
+ * Get a job from given lane. Returns false if empty.
+ */
+static bool lane_try_get(struct ml_worker_pool_lane_t *self_p,
+                         ml_worker_pool_job_entry_t *entry_p,
+                         void **arg_pp)
+{
+    struct ml_worker_pool_slot_t *slot_p;
+    unsigned int pos;
+    uint64_t spawn_time;
+
+    if (ml_ring_try_claim_read(&self_p->ring, 1, &pos) == 0) {
+        return (false);
+    }
+
+    slot_p = ml_ring_cell(&self_p->ring, pos);
+    *entry_p = slot_p->entry;
+    *arg_pp = slot_p->arg_p;
+    spawn_time = slot_p->spawn_time;
+    ml_ring_release(&self_p->ring, pos);
+    ml_waiters_signal(&self_p->full, 1);
+    lane_update_statistics(self_p, spawn_time);
+
+    return (true);
+}
+
+static void lane_put(struct ml_worker_pool_lane_t *self_p,
+                     ml_worker_pool_job_entry_t entry,
+                     void *arg_p,
+                     uint64_t spawn_time)
+{
+    unsigned int sequence;
+    bool done;
+
+    while (!lane_try_put(self_p, entry, arg_p, spawn_time)) {
+        sequence = ml_waiters_enter(&self_p->full);
+        done = lane_try_put(self_p, entry, arg_p, spawn_time);
+
+        if (!done) {
+            ml_waiters_wait(&self_p->full, sequence, NULL);
+        }
+
+        ml_waiters_leave(&self_p->full);
+
+        if (done) {
+            break;
+        }
+    }
+}
+
+/**
+ * Get a job from the highest priority non-empty lane, starting at
+ * given lane.
+ */
+static bool lanes_try_get_strict(struct ml_worker_pool_t *self_p,
+                                 int lane,
+                                 ml_worker_pool_job_entry_t *entry_p,
+                                 void **arg_pp)
+{
+    int i;
+
+    for (i = lane; i < self_p->number_of_lanes; i++) {
+        if (lane_try_get(&self_p->lanes_p[i], entry_p, arg_pp)) {
+            return (true);
+        }
+    }
+
+    return (false);
+}
+
+/**
+ * Deficit round robin. Each worker gets up to weight jobs from a
+ * lane before moving on to the next lane, or earlier if the lane is
+ * empty.
+ */
+static bool lanes_try_get_weighted(struct ml_worker_pool_worker_t *worker_p,
+                                   ml_worker_pool_job_entry_t *entry_p,
+                                   void **arg_pp)
+{
+    struct ml_worker_pool_t *self_p;
+    int i;
+
+    self_p = worker_p->pool_p;
+
+    for (i = 0; i <= self_p->number_of_lanes; i++) {
+        if ((worker_p->credits > 0)
+            && lane_try_get(&self_p->lanes_p[worker_p->lane],
+                            entry_p,
+                            arg_pp)) {
+            worker_p->credits--;
+
+            return (true);
+        }
+
+        worker_p->lane = ((worker_p->lane + 1) % self_p->number_of_lanes);
+        worker_p->credits = self_p->lanes_p[worker_p->lane].weight;
+    }
+
+    return (false);
+}
+
+static void overflow_push(struct ml_worker_pool_t *self_p,
+                          struct ml_worker_pool_job_t *job_p)
+{
+    struct ml_worker_pool_job_t *head_p;
+
+    /* Counted before it is linked, so the count never goes below the
+       number of jobs in the list. */
+    atomic_fetch_add_explicit(&self_p->number_of_overflow_jobs,
+                              1,
+                              memory_order_relaxed);
+    head_p = atomic_load_explicit(&self_p->overflow_p, memory_order_relaxed);
+
+    do {
+        job_p->next_p = head_p;
+    } while (!atomic_compare_exchange_weak_explicit(&self_p->overflow_p,
+                                                    &head_p,
+                                                    job_p,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/**
+ * Take all jobs in the overflow list, run the oldest, and move the
+ * others to the own deque. Jobs that do not fit are linked back into
+ * the list. Taking the whole list at once avoids the ABA problem of
+ * popping single jobs.
+ */
+static bool overflow_take(struct ml_worker_pool_worker_t *worker_p,
+                          ml_worker_pool_job_entry_t *entry_p,
+                          void **arg_pp)
+{
+    struct ml_worker_pool_t *self_p;
+    struct ml_worker_pool_job_t *job_p;
+    struct ml_worker_pool_job_t *next_p;
+    struct ml_worker_pool_job_t *reversed_p;
+    int number_of_jobs;
+
+    self_p = worker_p->pool_p;
+
+    if (atomic_load_explicit(&self_p->overflow_p,
+                             memory_order_relaxed) == NULL) {
+        return (false);
+    }
+
+    job_p = atomic_exchange_explicit(&self_p->overflow_p,
+                                     NULL,
+                                     memory_order_acquire);
+
+    if (job_p == NULL) {
+        return (false);
+    }
+
+    /* Oldest first. */
+    reversed_p = NULL;
+    number_of_jobs = 0;
+
+    while (job_p != NULL) {
+        next_p = job_p->next_p;
+        job_p->next_p = reversed_p;
+        reversed_p = job_p;
+        job_p = next_p;
+        number_of_jobs++;
+    }
+
+    atomic_fetch_sub_explicit(&self_p->number_of_overflow_jobs,
+                              number_of_jobs,
+                              memory_order_relaxed);
+    *entry_p = reversed_p->entry;
+    *arg_pp = reversed_p->arg_p;
+    lane_update_statistics(&self_p->lanes_p[0], reversed_p->spawn_time);
+    job_p = reversed_p->next_p;
+
+    while (job_p != NULL) {
+        next_p = job_p->next_p;
+
+        if (!deque_push(&worker_p->deque,
+                        job_p->entry,
+                        job_p->arg_p,
+                        job_p->spawn_time)) {
+            overflow_push(self_p, job_p);
+        }
+
+        job_p = next_p;
+    }
+
+    ml_waiters_signal(&self_p->idle, self_p->number_of_workers);
+
+    return (true);
+}
+
+/**
+ * Steal a lane zero(0) job from any other worker's deque.
+ */
+static bool steal_job(struct ml_worker_pool_worker_t *worker_p,
+                      ml_worker_pool_job_entry_t *entry_p,
+                      void **arg_pp)
+{
+    struct ml_worker_pool_t *self_p;
+    struct ml_worker_pool_worker_t *victim_p;
+    enum steal_result_t res;
+    uint64_t spawn_time;
+    int i;
+
+    self_p = worker_p->pool_p;
+
+    for (i = 1; i < self_p->number_of_workers; i++) {
+        victim_p = &self_p->workers_p[(worker_p->index + i)
+                                      % self_p->number_of_workers];
+
+        do {
+            res = deque_steal(&victim_p->deque, entry_p, arg_pp, &spawn_time);
+        } while (res == steal_result_retry_t);
+
+        if (res == steal_result_ok_t) {
+            lane_update_statistics(&self_p->lanes_p[0], spawn_time);
+
+            return (true);
+        }
+    }
+
+    return (false);
+}
+
+/**
+ * Find a job in the own deque, the lanes, the overflow list or in any
+ * other worker's deque, in that order. Deques and the overflow list
+ * only hold lane zero(0) jobs, so with strict priorities they are
+ * searched before lanes above zero(0).
+ */
+static bool find_job(struct ml_worker_pool_worker_t *worker_p,
+                     ml_worker_pool_job_entry_t *entry_p,
+                     void **arg_pp)
+{
+    struct ml_worker_pool_t *self_p;
+    uint64_t spawn_time;
+
+    self_p = worker_p->pool_p;
+
+    if (deque_take(&worker_p->deque, entry_p, arg_pp, &spawn_time)) {
+        lane_update_statistics(&self_p->lanes_p[0], spawn_time);
+
+        return (true);
+    }
+
+    if (self_p->is_weighted) {
+        if (lanes_try_get_weighted(worker_p, entry_p, arg_pp)) {
+            return (true);
+        }
+    } else if (lane_try_get(&self_p->lanes_p[0], entry_p, arg_pp)) {
+        return (true);
+    }
+
+    if (overflow_take(worker_p, entry_p, arg_pp)) {
+        return (true);
+    }
+
+    if (steal_job(worker_p, entry_p, arg_pp)) {
+        return (true);
+    }
+
+    if (self_p->is_weighted) {
+        return (false);
+    }
+
+    return (lanes_try_get_strict(self_p, 1, entry_p, arg_pp));
+}
+
+static bool is_elastic(struct ml_worker_pool_t *self_p)
+{
+    return (self_p->minimum_number_of_workers < self_p->number_of_workers);
+}
+
+/**
+ * Stop given idle worker if there are more than the minimum number of
+ * workers. The deque is empty once no job is found, and stays empty
+ * as only the owner pushes to it. Returns false and a job if one was
+ * spawned after the worker went idle.
+ *
+ * The worker is stopped before looking for jobs a last time. A
+ * spawner puts its job before the fence in ml_waiters_signal() and
+ * then reads the number of running workers in grow(), so either this
+ * worker finds the job, or the spawner sees that it stopped and
+ * starts a new worker.
+ */
+static bool worker_retire(struct ml_worker_pool_worker_t *worker_p,
+                          ml_worker_pool_job_entry_t *entry_p,
+                          void **arg_pp)
+{
+    struct ml_worker_pool_t *self_p;
+    bool retired;
+
+    self_p = worker_p->pool_p;
+    retired = false;
+    pthread_mutex_lock(&self_p->mutex);
+
+    if (atomic_load(&self_p->number_of_running_workers)
+        > self_p->minimum_number_of_workers) {
+        atomic_fetch_sub(&self_p->number_of_running_workers, 1);
+        worker_p->is_running = false;
+        retired = true;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (find_job(worker_p, entry_p, arg_pp)) {
+        if (retired) {
+            atomic_fetch_add(&self_p->number_of_running_workers, 1);
+            worker_p->is_running = true;
+            retired = false;
+        }
+    } else {
+        *entry_p = NULL;
+    }
+
+    pthread_mutex_unlock(&self_p->mutex);
+
+    return (retired);
+}
+
+static void worker_set_affinity(struct ml_worker_pool_worker_t *worker_p)
+{
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker_p->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
 
 static void *worker_pool_main(void *arg_p)
 {
+    struct ml_worker_pool_worker_t *worker_p;
     struct ml_worker_pool_t *self_p;
-    struct worker_pool_job_message_t *message_p;
+    ml_worker_pool_job_entry_t entry;
+    void *job_arg_p;
+    unsigned int sequence;
+    struct timespec deadline;
+    struct timespec *deadline_p;
+    bool found;
+    int res;
 
-    self_p = (struct ml_worker_pool_t *)arg_p;
+    worker_p = (struct ml_worker_pool_worker_t *)arg_p;
+    self_p = worker_p->pool_p;
+    current_worker_p = worker_p;
 
     pthread_setname_np(pthread_self(), "ml_worker_pool");
 
+    if (worker_p->cpu >= 0) {
+        worker_set_affinity(worker_p);
+    }
+
     while (true) {
-        (void)ml_queue_get(&self_p->jobs, (void **)&message_p);
-        message_p->entry(message_p->arg_p);
-        ml_message_free(message_p);
+        found = find_job(worker_p, &entry, &job_arg_p);
+
+        if (!found) {
+            deadline_p = NULL;
+
+            if (is_elastic(self_p) && (self_p->idle_timeout >= 0)) {
+                deadline_p = ml_make_deadline(&deadline, self_p->idle_timeout);
+            }
+
+            sequence = ml_waiters_enter(&self_p->idle);
+            found = find_job(worker_p, &entry, &job_arg_p);
+            res = 0;
+
+            if (!found) {
+                res = ml_waiters_wait(&self_p->idle, sequence, deadline_p);
+            }
+
+            ml_waiters_leave(&self_p->idle);
+
+            if (res == -ETIMEDOUT) {
+                if (worker_retire(worker_p, &entry, &job_arg_p)) {
+                    break;
+                }
+
+                found = (entry != NULL);
+            }
+        }
+
+        if (found) {
+            entry(job_arg_p);
+        }
     }
 
+    /* Joined when the slot is reused. */
+    current_worker_p = NULL;
+
     return (NULL);
 }
 
+/**
+ * Start given stopped worker. Called with the pool mutex held. The
+ * thread of a retired worker has released the mutex for good, and is
+ * joined before its handle is replaced.
+ */
+static void worker_start(struct ml_worker_pool_worker_t *worker_p)
+{
+    struct ml_worker_pool_t *self_p;
+
+    self_p = worker_p->pool_p;
+
+    if (worker_p->has_pthread) {
+        pthread_join(self_p->pthreads_p[worker_p->index], NULL);
+        worker_p->has_pthread = false;
+    }
+
+    worker_p->is_running = true;
+    atomic_fetch_add(&self_p->number_of_running_workers, 1);
+
+    if (pthread_create(&self_p->pthreads_p[worker_p->index],
+                       NULL,
+                       worker_pool_main,
+                       worker_p) == 0) {
+        worker_p->has_pthread = true;
+    } else {
+        worker_p->is_running = false;
+        atomic_fetch_sub(&self_p->number_of_running_workers, 1);
+    }
+}
+
+/**
+ * Add a worker to an elastic pool if no worker is idle, unless the
+ * pool is at its maximum size. Spawners call ml_waiters_signal()
+ * first, which orders the put job before the reads below, as
+ * worker_retire() relies on.
+ */
+static void grow(struct ml_worker_pool_t *self_p)
+{
+    int i;
+
+    if (!is_elastic(self_p)) {
+        return;
+    }
+
+    if (atomic_load_explicit(&self_p->idle.count, memory_order_relaxed) > 0) {
+        return;
+    }
+
+    if (atomic_load_explicit(&self_p->number_of_running_workers,
+                             memory_order_relaxed)
+        >= self_p->number_of_workers) {
+        return;
+    }
+
+    pthread_mutex_lock(&self_p->mutex);
+
+    if (atomic_load(&self_p->idle.count) == 0) {
+        for (i = 0; i < self_p->number_of_workers; i++) {
+            if (!self_p->workers_p[i].is_running) {
+                worker_start(&self_p->workers_p[i]);
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&self_p->mutex);
+}
+
+static void init(struct ml_worker_pool_t *self_p,
+                 int minimum_number_of_workers,
+                 int number_of_workers,
+                 int maximum_number_of_workers,
+                 int idle_timeout,
+                 int job_queue_length,
+                 int number_of_lanes,
+                 const int *weights_p,
+                 const int *cpus_p)
+{
+    struct ml_worker_pool_worker_t *worker_p;
+    int i;
+
+    self_p->number_of_workers = maximum_number_of_workers;
+    self_p->minimum_number_of_workers = minimum_number_of_workers;
+    self_p->idle_timeout = idle_timeout;
+    pthread_mutex_init(&self_p->mutex, NULL);
+    atomic_init(&self_p->number_of_running_workers, 0);
+    self_p->pthreads_p = xmalloc(sizeof(*self_p->pthreads_p)
+                                 * (size_t)maximum_number_of_workers);
+    self_p->workers_p = xmalloc(sizeof(*self_p->workers_p)
+                                * (size_t)maximum_number_of_workers);
+    self_p->number_of_lanes = number_of_lanes;
+    self_p->lanes_p = xmalloc(sizeof(*self_p->lanes_p)
+                              * (size_t)number_of_lanes);
+    self_p->is_weighted = (weights_p != NULL);
+
+    for (i = 0; i < number_of_lanes; i++) {
+        lane_init(&self_p->lanes_p[i],
+                  job_queue_length,
+                  weights_p != NULL ? weights_p[i] : 1);
+    }
+
+    atomic_init(&self_p->overflow_p, NULL);
+    atomic_init(&self_p->number_of_overflow_jobs, 0);
+    atomic_init(&self_p->is_lane_statistics_enabled, false);
+    ml_waiters_init(&self_p->idle);
+
+    for (i = 0; i < maximum_number_of_workers; i++) {
+        worker_p = &self_p->workers_p[i];
+        worker_p->pool_p = self_p;
+        worker_p->index = i;
+        worker_p->lane = 0;
+        worker_p->credits = self_p->lanes_p[0].weight;
+        worker_p->cpu = (cpus_p != NULL ? cpus_p[i] : -1);
+        worker_p->is_running = false;
+        worker_p->has_pthread = false;
+        deque_init(&worker_p->deque);
+    }
+
+    pthread_mutex_lock(&self_p->mutex);
+
+    for (i = 0; i < number_of_workers; i++) {
+        worker_start(&self_p->workers_p[i]);
+    }
+
+    pthread_mutex_unlock(&self_p->mutex);
+}
+
 void ml_worker_pool_init(struct ml_worker_pool_t *self_p,
                          int number_of_workers,
                          int job_queue_length)
 {
-    int i;
+    ml_worker_pool_init_lanes(self_p,
+                              number_of_workers,
+                              job_queue_length,
+                              1,
+                              NULL);
+}
 
-    ml_queue_init(&self_p->jobs, job_queue_length);
+void ml_worker_pool_init_lanes(struct ml_worker_pool_t *self_p,
+                               int number_of_workers,
+                               int job_queue_length,
+                               int number_of_lanes,
+                               const int *weights_p)
+{
+    init(self_p,
+         number_of_workers,
+         number_of_workers,
+         number_of_workers,
+         -1,
+         job_queue_length,
+         number_of_lanes,
+         weights_p,
+         NULL);
+}
 
-    for (i = 0; i < number_of_workers; i++) {
-        pthread_create(&self_p->pthread, NULL, worker_pool_main, self_p);
+void ml_worker_pool_init_elastic(struct ml_worker_pool_t *self_p,
+                                 int minimum_number_of_workers,
+                                 int maximum_number_of_workers,
+                                 int idle_timeout,
+                                 int job_queue_length,
+                                 const int *cpus_p)
+{
+    int number_of_workers;
+
+    number_of_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (number_of_workers < minimum_number_of_workers) {
+        number_of_workers = minimum_number_of_workers;
+    }
+
+    if (number_of_workers > maximum_number_of_workers) {
+        number_of_workers = maximum_number_of_workers;
     }
+
+    init(self_p,
+         minimum_number_of_workers,
+         number_of_workers,
+         maximum_number_of_workers,
+         idle_timeout,
+         job_queue_length,
+         1,
+         NULL,
+         cpus_p);
+}
+
+int ml_worker_pool_get_number_of_workers(struct ml_worker_pool_t *self_p)
+{
+    return (atomic_load(&self_p->number_of_running_workers));
 }
 
 void ml_worker_pool_spawn(struct ml_worker_pool_t *self_p,
                           ml_worker_pool_job_entry_t entry,
                           void *arg_p)
 {
-    struct worker_pool_job_message_t *message_p;
+    ml_worker_pool_spawn_lane(self_p, 0, entry, arg_p);
+}
+
+void ml_worker_pool_spawn_lane(struct ml_worker_pool_t *self_p,
+                               int lane,
+                               ml_worker_pool_job_entry_t entry,
+                               void *arg_p)
+{
+    struct ml_worker_pool_worker_t *worker_p;
+    uint64_t spawn_time;
+
+    worker_p = current_worker_p;
+    spawn_time = make_spawn_time(self_p);
+
+    if ((lane != 0)
+        || (worker_p == NULL)
+        || (worker_p->pool_p != self_p)
+        || !deque_push(&worker_p->deque, entry, arg_p, spawn_time)) {
+        if (!lane_try_put(&self_p->lanes_p[lane], entry, arg_p, spawn_time)) {
+            grow(self_p);
+            lane_put(&self_p->lanes_p[lane], entry, arg_p, spawn_time);
+        }
+
+        ml_waiters_signal(&self_p->idle, 1);
+        grow(self_p);
+    } else {
+        ml_waiters_signal(&self_p->idle, 1);
+    }
+}
+
+void ml_worker_pool_get_lane_statistics(
+    struct ml_worker_pool_t *self_p,
+    int lane,
+    struct ml_worker_pool_lane_statistics_t *statistics_p)
+{
+    struct ml_worker_pool_lane_t *lane_p;
+    int i;
+
+    lane_p = &self_p->lanes_p[lane];
+    statistics_p->depth = ml_ring_get_length(&lane_p->ring);
+
+    if (lane == 0) {
+        for (i = 0; i < self_p->number_of_workers; i++) {
+            statistics_p->depth += deque_get_length(
+                &self_p->workers_p[i].deque);
+        }
+
+        statistics_p->depth += (unsigned int)atomic_load_explicit(
+            &self_p->number_of_overflow_jobs,
+            memory_order_relaxed);
+    }
+
+    statistics_p->number_of_jobs =
+        atomic_load(&lane_p->statistics.number_of_jobs);
+    statistics_p->total_wait_time =
+        atomic_load(&lane_p->statistics.total_wait_time);
+    statistics_p->max_wait_time =
+        atomic_load(&lane_p->statistics.max_wait_time);
+}
+
+void ml_worker_pool_set_lane_statistics(struct ml_worker_pool_t *self_p,
+                                        bool enabled)
+{
+    atomic_store(&self_p->is_lane_statistics_enabled, enabled);
+}
+
+void ml_worker_pool_job_init(struct ml_worker_pool_job_t *self_p,
+                             ml_worker_pool_job_entry_t entry,
+                             void *arg_p)
+{
+    self_p->entry = entry;
+    self_p->arg_p = arg_p;
+    self_p->next_p = NULL;
+}
+
+void ml_worker_pool_spawn_job(struct ml_worker_pool_t *self_p,
+                              struct ml_worker_pool_job_t *job_p)
+{
+    struct ml_worker_pool_worker_t *worker_p;
+
+    worker_p = current_worker_p;
+    job_p->spawn_time = make_spawn_time(self_p);
+
+    if ((worker_p == NULL)
+        || (worker_p->pool_p != self_p)
+        || !deque_push(&worker_p->deque,
+                       job_p->entry,
+                       job_p->arg_p,
+                       job_p->spawn_time)) {
+        if (!lane_try_put(&self_p->lanes_p[0],
+                          job_p->entry,
+                          job_p->arg_p,
+                          job_p->spawn_time)) {
+            overflow_push(self_p, job_p);
+        }
+
+        ml_waiters_signal(&self_p->idle, 1);
+        grow(self_p);
+    } else {
+        ml_waiters_signal(&self_p->idle, 1);
+    }
+}
+
+static void future_spawn(struct ml_worker_pool_future_t *self_p,
+                         void *arg_p);
+
+static void future_main(void *arg_p)
+{
+    struct ml_worker_pool_future_t *self_p;
+    struct ml_worker_pool_future_t *next_p;
+    void *result_p;
+
+    self_p = (struct ml_worker_pool_future_t *)arg_p;
+    result_p = self_p->entry(self_p->arg_p);
+    self_p->result_p = result_p;
+    next_p = atomic_exchange(&self_p->next_p, FUTURE_COMPLETED);
+
+    /* The future may be reused by a waiter once done. */
+    if (atomic_exchange(&self_p->state, FUTURE_STATE_DONE)
+        == FUTURE_STATE_PENDING_WITH_WAITERS) {
+        ml_futex_wake(&self_p->state, INT_MAX);
+    }
+
+    if (next_p != NULL) {
+        future_spawn(next_p, result_p);
+    }
+}
+
+static void future_init(struct ml_worker_pool_future_t *self_p,
+                        struct ml_worker_pool_t *pool_p,
+                        ml_worker_pool_future_entry_t entry)
+{
+    self_p->pool_p = pool_p;
+    self_p->entry = entry;
+    self_p->result_p = NULL;
+    atomic_init(&self_p->state, FUTURE_STATE_PENDING);
+    atomic_init(&self_p->next_p, NULL);
+}
+
+static void future_spawn(struct ml_worker_pool_future_t *self_p,
+                         void *arg_p)
+{
+    self_p->arg_p = arg_p;
+    ml_worker_pool_job_init(&self_p->job, future_main, self_p);
+    ml_worker_pool_spawn_job(self_p->pool_p, &self_p->job);
+}
+
+/**
+ * Run one job if called by a worker in given pool. Returns true if a
+ * job was run.
+ */
+static bool help(struct ml_worker_pool_t *self_p)
+{
+    struct ml_worker_pool_worker_t *worker_p;
+    ml_worker_pool_job_entry_t entry;
+    void *arg_p;
+
+    worker_p = current_worker_p;
+
+    if ((worker_p == NULL) || (worker_p->pool_p != self_p)) {
+        return (false);
+    }
+
+    if (!find_job(worker_p, &entry, &arg_p)) {
+        return (false);
+    }
+
+    entry(arg_p);
+
+    return (true);
+}
+
+void ml_worker_pool_submit(struct ml_worker_pool_t *self_p,
+                           struct ml_worker_pool_future_t *future_p,
+                           ml_worker_pool_future_entry_t entry,
+                           void *arg_p)
+{
+    future_init(future_p, self_p, entry);
+    future_spawn(future_p, arg_p);
+}
+
+void *ml_worker_pool_future_wait(struct ml_worker_pool_future_t *self_p)
+{
+    void *result_p;
+
+    ml_worker_pool_future_wait_timeout(self_p, -1, &result_p);
+
+    return (result_p);
+}
+
+int ml_worker_pool_future_wait_timeout(struct ml_worker_pool_future_t *self_p,
+                                       int timeout,
+                                       void **result_pp)
+{
+    struct timespec deadline;
+    struct timespec *deadline_p;
+    unsigned int state;
+    int res;
+
+    deadline_p = NULL;
+
+    if (timeout > 0) {
+        deadline_p = ml_make_deadline(&deadline, timeout);
+    }
+
+    while (true) {
+        state = atomic_load(&self_p->state);
+
+        if (state == FUTURE_STATE_DONE) {
+            break;
+        }
+
+        if (help(self_p->pool_p)) {
+            continue;
+        }
+
+        if (timeout == 0) {
+            return (-ETIMEDOUT);
+        }
+
+        if (state == FUTURE_STATE_PENDING) {
+            if (!atomic_compare_exchange_strong(
+                    &self_p->state,
+                    &state,
+                    FUTURE_STATE_PENDING_WITH_WAITERS)) {
+                continue;
+            }
+        }
+
+        if (current_worker_p != NULL) {
+            grow(current_worker_p->pool_p);
+        }
+
+        res = ml_futex_wait(&self_p->state,
+                            FUTURE_STATE_PENDING_WITH_WAITERS,
+                            deadline_p);
+
+        if ((res == -1) && (errno == ETIMEDOUT)) {
+            return (-ETIMEDOUT);
+        }
+    }
+
+    *result_pp = self_p->result_p;
+
+    return (0);
+}
+
+int ml_worker_pool_future_then(struct ml_worker_pool_future_t *self_p,
+                               struct ml_worker_pool_future_t *next_p,
+                               ml_worker_pool_future_entry_t entry)
+{
+    struct ml_worker_pool_future_t *expected_p;
+
+    future_init(next_p, self_p->pool_p, entry);
+    expected_p = NULL;
+
+    if (atomic_compare_exchange_strong(&self_p->next_p,
+                                       &expected_p,
+                                       next_p)) {
+        return (0);
+    }
+
+    if (expected_p != FUTURE_COMPLETED) {
+        return (-EBUSY);
+    }
+
+    /* Already done, run the continuation right away. */
+    future_spawn(next_p, self_p->result_p);
+
+    return (0);
+}
+
+void ml_worker_pool_wait_all(struct ml_worker_pool_future_t *futures_p,
+                             int length)
+{
+    int i;
+
+    for (i = 0; i < length; i++) {
+        (void)ml_worker_pool_future_wait(&futures_p[i]);
+    }
+}
+
+struct parallel_t {
+    atomic_size_t next;
+    size_t end;
+    size_t grain;
+    size_t number_of_items;
+    int number_of_participants;
+    ml_parallel_for_entry_t entry;
+    ml_parallel_map_t map;
+    ml_parallel_reduce_t reduce;
+    void *arg_p;
+    uint64_t identity;
+    _Atomic uint64_t result;
+    atomic_size_t number_of_done_items;
+    atomic_int count;
+    struct ml_waiters_t done;
+    struct ml_worker_pool_job_t jobs[];
+};
+
+/**
+ * Claim the next chunk, with a size of about half the remaining range
+ * divided among all participants, but at least the grain size.
+ */
+static bool parallel_claim(struct parallel_t *self_p,
+                           size_t *begin_p,
+                           size_t *end_p)
+{
+    size_t begin;
+    size_t size;
 
-    message_p = ml_message_alloc(&worker_pool_job_mid, sizeof(*message_p));
-    message_p->entry = entry;
-    message_p->arg_p = arg_p;
-    ml_queue_put(&self_p->jobs, message_p);
+    begin = atomic_load_explicit(&self_p->next, memory_order_relaxed);
+
+    do {
+        if (begin >= self_p->end) {
+            return (false);
+        }
+
+        size = ((self_p->end - begin)
+                / (2 * (size_t)self_p->number_of_participants));
+
+        if (size < self_p->grain) {
+            size = self_p->grain;
+        }
+
+        if (size > self_p->end - begin) {
+            size = (self_p->end - begin);
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&self_p->next,
+                                                    &begin,
+                                                    begin + size,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    *begin_p = begin;
+    *end_p = begin + size;
+
+    return (true);
+}
+
+static void parallel_release(struct parallel_t *self_p)
+{
+    if (atomic_fetch_sub(&self_p->count, 1) == 1) {
+        free(self_p);
+    }
+}
+
+static void parallel_run(struct parallel_t *self_p)
+{
+    size_t begin;
+    size_t end;
+    size_t number_of_items;
+    uint64_t value;
+    uint64_t result;
+    uint64_t combined;
+
+    number_of_items = 0;
+    value = self_p->identity;
+
+    while (parallel_claim(self_p, &begin, &end)) {
+        if (self_p->entry != NULL) {
+            self_p->entry(begin, end, self_p->arg_p);
+        } else {
+            value = self_p->reduce(value,
+                                   self_p->map(begin, end, self_p->arg_p));
+        }
+
+        number_of_items += (end - begin);
+    }
+
+    if (number_of_items == 0) {
+        return;
+    }
+
+    if (self_p->entry == NULL) {
+        result = atomic_load(&self_p->result);
+
+        do {
+            combined = self_p->reduce(result, value);
+        } while (!atomic_compare_exchange_weak(&self_p->result,
+                                               &result,
+                                               combined));
+    }
+
+    if (atomic_fetch_add(&self_p->number_of_done_items, number_of_items)
+        + number_of_items == self_p->number_of_items) {
+        ml_waiters_signal(&self_p->done, 1);
+    }
+}
+
+static void parallel_job_main(void *arg_p)
+{
+    struct parallel_t *self_p;
+
+    self_p = (struct parallel_t *)arg_p;
+    parallel_run(self_p);
+    parallel_release(self_p);
+}
+
+static uint64_t parallel(struct ml_worker_pool_t *pool_p,
+                         size_t begin,
+                         size_t end,
+                         size_t grain,
+                         ml_parallel_for_entry_t entry,
+                         uint64_t identity,
+                         ml_parallel_map_t map,
+                         ml_parallel_reduce_t reduce,
+                         void *arg_p)
+{
+    struct parallel_t *self_p;
+    size_t number_of_chunks;
+    int number_of_jobs;
+    unsigned int sequence;
+    uint64_t result;
+    int i;
+
+    if (begin >= end) {
+        return (identity);
+    }
+
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    number_of_chunks = ((end - begin + grain - 1) / grain);
+    number_of_jobs = ml_worker_pool_get_number_of_workers(pool_p);
+
+    if (number_of_chunks - 1 < (size_t)number_of_jobs) {
+        number_of_jobs = (int)(number_of_chunks - 1);
+    }
+
+    self_p = xmalloc(sizeof(*self_p)
+                     + sizeof(self_p->jobs[0]) * (size_t)number_of_jobs);
+    atomic_init(&self_p->next, begin);
+    self_p->end = end;
+    self_p->grain = grain;
+    self_p->number_of_items = (end - begin);
+    self_p->number_of_participants = (number_of_jobs + 1);
+    self_p->entry = entry;
+    self_p->map = map;
+    self_p->reduce = reduce;
+    self_p->arg_p = arg_p;
+    self_p->identity = identity;
+    atomic_init(&self_p->result, identity);
+    atomic_init(&self_p->number_of_done_items, 0);
+    atomic_init(&self_p->count, number_of_jobs + 1);
+    ml_waiters_init(&self_p->done);
+
+    for (i = 0; i < number_of_jobs; i++) {
+        ml_worker_pool_job_init(&self_p->jobs[i], parallel_job_main, self_p);
+        ml_worker_pool_spawn_job(pool_p, &self_p->jobs[i]);
+    }
+
+    parallel_run(self_p);
+
+    while (atomic_load(&self_p->number_of_done_items)
+           != self_p->number_of_items) {
+        sequence = ml_waiters_enter(&self_p->done);
+
+        if (atomic_load(&self_p->number_of_done_items)
+            != self_p->number_of_items) {
+            ml_waiters_wait(&self_p->done, sequence, NULL);
+        }
+
+        ml_waiters_leave(&self_p->done);
+    }
+
+    result = atomic_load(&self_p->result);
+    parallel_release(self_p);
+
+    return (result);
+}
+
+void ml_parallel_for(struct ml_worker_pool_t *pool_p,
+                     size_t begin,
+                     size_t end,
+                     size_t grain,
+                     ml_parallel_for_entry_t entry,
+                     void *arg_p)
+{
+    parallel(pool_p, begin, end, grain, entry, 0, NULL, NULL, arg_p);
+}
+
+uint64_t ml_parallel_reduce(struct ml_worker_pool_t *pool_p,
+                            size_t begin,
+                            size_t end,
+                            size_t grain,
+                            uint64_t identity,
+                            ml_parallel_map_t map,
+                            ml_parallel_reduce_t reduce,
+                            void *arg_p)
+{
+    return (parallel(pool_p,
+                     begin,
+                     end,
+                     grain,
+                     NULL,
+                     identity,
+                     map,
+                     reduce,
+                     arg_p));
 }
@@ -26,6 +26,7 @@
  * This file is part of the Monolinux C library project.
  */
 
+#include <errno.h>
 #include <unistd.h>
 #include "nala.h"
 #include "ml/ml.h"
@@ -129,3 +130,281 @@ TEST(broadcast_no_subsciber)
     ASSERT_NE(bmessage_p, NULL);
     ml_bus_broadcast(&bus, bmessage_p);
 }
+
+TEST(many_message_identifiers)
+{
+    static struct ml_uid_t uids[200];
+    struct ml_queue_t queue_3;
+    struct ml_uid_t *uid_p;
+    void *bmessage_p;
+    void *message_p;
+    int i;
+
+    ml_queue_init(&queue_1, 1);
+    ml_queue_init(&queue_2, 1);
+    ml_queue_init(&queue_3, 1);
+    ml_bus_init(&bus);
+
+    for (i = 0; i < 200; i++) {
+        uids[i].name_p = "uid";
+
+        if ((i % 2) == 0) {
+            ml_bus_subscribe(&bus, &queue_1, &uids[i]);
+        }
+
+        ml_bus_subscribe(&bus, &queue_2, &uids[i]);
+    }
+
+    ml_bus_subscribe(&bus, &queue_3, &m1);
+
+    for (i = 0; i < 200; i++) {
+        bmessage_p = ml_message_alloc(&uids[i], 0);
+        ml_bus_broadcast(&bus, bmessage_p);
+
+        if ((i % 2) == 0) {
+            uid_p = ml_queue_get(&queue_1, &message_p);
+            ASSERT_EQ(uid_p, &uids[i]);
+            ASSERT_EQ(message_p, bmessage_p);
+            ml_message_free(message_p);
+        }
+
+        uid_p = ml_queue_get(&queue_2, &message_p);
+        ASSERT_EQ(uid_p, &uids[i]);
+        ASSERT_EQ(message_p, bmessage_p);
+        ml_message_free(message_p);
+    }
+
+    /* Not subscribed. */
+    bmessage_p = ml_message_alloc(&m2, 0);
+    ml_bus_broadcast(&bus, bmessage_p);
+    ASSERT_EQ(ml_queue_try_get(&queue_1, &message_p), NULL);
+    ASSERT_EQ(ml_queue_try_get(&queue_2, &message_p), NULL);
+    ASSERT_EQ(ml_queue_try_get(&queue_3, &message_p), NULL);
+}
+
+TEST(unsubscribe)
+{
+    struct ml_uid_t *uid_p;
+    void *bmessage_p;
+    void *message_p;
+
+    ml_queue_init(&queue_1, 1);
+    ml_queue_init(&queue_2, 1);
+    ml_bus_init(&bus);
+    ml_bus_subscribe(&bus, &queue_1, &m1);
+    ml_bus_subscribe(&bus, &queue_2, &m1);
+    ASSERT_EQ(ml_bus_unsubscribe(&bus, &queue_1, &m1), 0);
+    ASSERT_EQ(ml_bus_unsubscribe(&bus, &queue_1, &m1), -ENOENT);
+    ASSERT_EQ(ml_bus_unsubscribe(&bus, &queue_1, &m2), -ENOENT);
+
+    /* Only the second queue gets the message. */
+    bmessage_p = ml_message_alloc(&m1, 0);
+    ml_bus_broadcast(&bus, bmessage_p);
+    ASSERT_EQ(ml_queue_try_get(&queue_1, &message_p), NULL);
+    uid_p = ml_queue_get(&queue_2, &message_p);
+    ASSERT_EQ(uid_p, &m1);
+    ASSERT_EQ(message_p, bmessage_p);
+    ml_message_free(message_p);
+
+    /* No subscribers left. */
+    ASSERT_EQ(ml_bus_unsubscribe(&bus, &queue_2, &m1), 0);
+    bmessage_p = ml_message_alloc(&m1, 0);
+    ml_bus_broadcast(&bus, bmessage_p);
+    ASSERT_EQ(ml_queue_try_get(&queue_2, &message_p), NULL);
+
+    /* Subscribe again. */
+    ml_bus_subscribe(&bus, &queue_1, &m1);
+    bmessage_p = ml_message_alloc(&m1, 0);
+    ml_bus_broadcast(&bus, bmessage_p);
+    uid_p = ml_queue_get(&queue_1, &message_p);
+    ASSERT_EQ(uid_p, &m1);
+    ml_message_free(message_p);
+}
+
+static atomic_bool is_broadcasting;
+
+static void *broadcast_main(void *arg_p)
+{
+    (void)arg_p;
+
+    while (atomic_load(&is_broadcasting)) {
+        ml_bus_broadcast(&bus, ml_message_alloc(&m1, 0));
+    }
+
+    return (NULL);
+}
+
+TEST(subscribe_while_broadcasting)
+{
+    pthread_t pthreads[2];
+    void *message_p;
+    int i;
+
+    ml_queue_init(&queue_1, 16);
+    ml_bus_init(&bus);
+    atomic_store(&is_broadcasting, true);
+
+    for (i = 0; i < 2; i++) {
+        pthread_create(&pthreads[i], NULL, broadcast_main, NULL);
+    }
+
+    for (i = 0; i < 100; i++) {
+        ml_bus_subscribe(&bus, &queue_1, &m1);
+        ASSERT_EQ(ml_queue_get(&queue_1, &message_p), &m1);
+        ml_message_free(message_p);
+        ASSERT_EQ(ml_bus_unsubscribe(&bus, &queue_1, &m1), 0);
+
+        while (ml_queue_try_get(&queue_1, &message_p) != NULL) {
+            ml_message_free(message_p);
+        }
+    }
+
+    atomic_store(&is_broadcasting, false);
+
+    for (i = 0; i < 2; i++) {
+        pthread_join(pthreads[i], NULL);
+    }
+
+    /* No broadcast is in progress. */
+    while (ml_queue_try_get(&queue_1, &message_p) != NULL) {
+        ml_message_free(message_p);
+    }
+
+    ml_bus_broadcast(&bus, ml_message_alloc(&m1, 0));
+    ASSERT_EQ(ml_queue_try_get(&queue_1, &message_p), NULL);
+}
+
+static void *alloc_int(struct ml_uid_t *uid_p, int value)
+{
+    int *value_p;
+
+    value_p = ml_message_alloc(uid_p, sizeof(*value_p));
+    *value_p = value;
+
+    return (value_p);
+}
+
+static int get_int(struct ml_queue_t *queue_p, struct ml_uid_t *uid_p)
+{
+    int *value_p;
+    int value;
+
+    ASSERT_EQ(ml_queue_get(queue_p, (void **)&value_p), uid_p);
+    value = *value_p;
+    ml_message_free(value_p);
+
+    return (value);
+}
+
+TEST(overflow_policy_drop_newest)
+{
+    void *message_p;
+
+    ml_queue_init(&queue_1, 2);
+    ml_queue_init(&queue_2, 2);
+    ml_bus_init(&bus);
+    ml_bus_subscribe_with_policy(&bus,
+                                 &queue_1,
+                                 &m1,
+                                 ml_bus_overflow_policy_drop_newest_t);
+    ml_bus_subscribe_with_policy(&bus,
+                                 &queue_2,
+                                 &m1,
+                                 ml_bus_overflow_policy_drop_newest_t);
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m1), 0);
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m2), -ENOENT);
+
+    ml_bus_broadcast(&bus, alloc_int(&m1, 1));
+    ml_bus_broadcast(&bus, alloc_int(&m1, 2));
+
+    /* The second queue is not full after this. */
+    ASSERT_EQ(get_int(&queue_2, &m1), 1);
+
+    ml_bus_broadcast(&bus, alloc_int(&m1, 3));
+    ml_bus_broadcast(&bus, alloc_int(&m1, 4));
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m1), 2);
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_2, &m1), 1);
+
+    ASSERT_EQ(get_int(&queue_1, &m1), 1);
+    ASSERT_EQ(get_int(&queue_1, &m1), 2);
+    ASSERT_EQ(ml_queue_try_get(&queue_1, &message_p), NULL);
+    ASSERT_EQ(get_int(&queue_2, &m1), 2);
+    ASSERT_EQ(get_int(&queue_2, &m1), 3);
+    ASSERT_EQ(ml_queue_try_get(&queue_2, &message_p), NULL);
+}
+
+TEST(overflow_policy_drop_oldest)
+{
+    void *message_p;
+
+    ml_queue_init(&queue_1, 2);
+    ml_bus_init(&bus);
+    ml_bus_subscribe_with_policy(&bus,
+                                 &queue_1,
+                                 &m1,
+                                 ml_bus_overflow_policy_drop_oldest_t);
+    ml_bus_subscribe_with_policy(&bus,
+                                 &queue_1,
+                                 &m2,
+                                 ml_bus_overflow_policy_drop_oldest_t);
+
+    /* The oldest message, 1, has the same id, so it is dropped. */
+    ml_bus_broadcast(&bus, alloc_int(&m1, 1));
+    ml_bus_broadcast(&bus, alloc_int(&m2, 2));
+    ml_bus_broadcast(&bus, alloc_int(&m1, 3));
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m1), 1);
+
+    /* The oldest message, 2, belongs to another subscription, so the
+       broadcasted message is dropped instead. */
+    ml_bus_broadcast(&bus, alloc_int(&m1, 4));
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m1), 2);
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m2), 0);
+
+    ASSERT_EQ(get_int(&queue_1, &m2), 2);
+    ml_bus_broadcast(&bus, alloc_int(&m1, 5));
+    ml_bus_broadcast(&bus, alloc_int(&m1, 6));
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m1), 3);
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m2), 0);
+
+    ASSERT_EQ(get_int(&queue_1, &m1), 5);
+    ASSERT_EQ(get_int(&queue_1, &m1), 6);
+    ASSERT_EQ(ml_queue_try_get(&queue_1, &message_p), NULL);
+}
+
+TEST(overflow_policy_coalesce)
+{
+    void *message_p;
+
+    ml_queue_init(&queue_1, 2);
+    ml_bus_init(&bus);
+    ml_bus_subscribe_with_policy(&bus,
+                                 &queue_1,
+                                 &m1,
+                                 ml_bus_overflow_policy_coalesce_t);
+    ml_bus_subscribe_with_policy(&bus,
+                                 &queue_1,
+                                 &m2,
+                                 ml_bus_overflow_policy_coalesce_t);
+
+    /* Only the latest message of each id is kept. */
+    ml_bus_broadcast(&bus, alloc_int(&m1, 1));
+    ml_bus_broadcast(&bus, alloc_int(&m2, 2));
+    ml_bus_broadcast(&bus, alloc_int(&m1, 3));
+    ml_bus_broadcast(&bus, alloc_int(&m1, 4));
+    ml_bus_broadcast(&bus, alloc_int(&m2, 5));
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m1), 2);
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m2), 1);
+
+    ASSERT_EQ(get_int(&queue_1, &m1), 4);
+
+    /* Taken by the consumer, so put a new one. */
+    ml_bus_broadcast(&bus, alloc_int(&m1, 6));
+    ASSERT_EQ(ml_bus_get_number_of_drops(&bus, &queue_1, &m1), 2);
+
+    ASSERT_EQ(get_int(&queue_1, &m2), 5);
+    ASSERT_EQ(get_int(&queue_1, &m1), 6);
+    ASSERT_EQ(ml_queue_try_get(&queue_1, &message_p), NULL);
+
+    ASSERT_EQ(ml_bus_unsubscribe(&bus, &queue_1, &m1), 0);
+    ASSERT_EQ(ml_bus_unsubscribe(&bus, &queue_1, &m2), 0);
+}
@@ -478,10 +478,10 @@ static void mock_push_ml_dhcp_client_start(void)
         &mac_address[0],
         sizeof(mac_address));
     mock_push_setup_packet_socket();
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, RENEW_FD);
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, REBIND_FD);
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, RESP_FD);
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, INIT_FD);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, RENEW_FD);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, REBIND_FD);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, RESP_FD);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, INIT_FD);
     memset(&timeout, 0, sizeof(timeout));
     timeout.it_value.tv_sec = 0;
     timeout.it_value.tv_nsec = 1;
@@ -655,10 +655,10 @@ TEST(start_failure_last_init_step)
                          sizeof(yes),
                          0);
     setsockopt_mock_set_optval_in(&yes, sizeof(yes));
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, RENEW_FD);
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, REBIND_FD);
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, RESP_FD);
-    timerfd_create_mock_once(CLOCK_REALTIME, 0, -1);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, RENEW_FD);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, REBIND_FD);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, RESP_FD);
+    timerfd_create_mock_once(CLOCK_BOOTTIME, 0, -1);
     close_mock_once(RESP_FD, 0);
     close_mock_once(REBIND_FD, 0);
     close_mock_once(RENEW_FD, 0);
@@ -28,6 +28,8 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include "nala.h"
 #include "ml/ml.h"
 
@@ -116,6 +118,110 @@ TEST(enable_disable)
     ASSERT_NOT_SUBSTRING(output1, " DEBUG foo bar\n");
 }
 
+TEST(milliseconds)
+{
+    struct ml_log_object_t log_object;
+
+    ml_log_object_module_init(NULL);
+    ml_log_object_init(&log_object, "foo", ML_LOG_INFO);
+
+    CAPTURE_OUTPUT(output1, errput1) {
+        ml_log_object_print(&log_object, ML_LOG_INFO, "bar");
+        ml_log_object_print(&log_object, ML_LOG_INFO, "fie");
+    }
+
+    /* "YYYY-MM-DD HH:MM:SS INFO foo bar\n" */
+    ASSERT_EQ(output1[19], ' ');
+    ASSERT_SUBSTRING(output1, " INFO foo bar\n");
+    ASSERT_SUBSTRING(output1, " INFO foo fie\n");
+
+    ml_log_object_module_set_milliseconds(true);
+
+    CAPTURE_OUTPUT(output2, errput2) {
+        ml_log_object_print(&log_object, ML_LOG_INFO, "bar");
+    }
+
+    /* "YYYY-MM-DD HH:MM:SS.mmm INFO foo bar\n" */
+    ASSERT_EQ(output2[19], '.');
+    ASSERT_EQ(output2[23], ' ');
+    ASSERT_SUBSTRING(output2, " INFO foo bar\n");
+
+    ml_log_object_module_set_milliseconds(false);
+}
+
+static int next_value(int *value_p)
+{
+    (*value_p)++;
+
+    return (*value_p);
+}
+
+TEST(macros_evaluate_arguments_only_if_enabled)
+{
+    struct {
+        struct ml_log_object_t log_object;
+    } foo;
+    typeof(foo) *self_p;
+    int value;
+
+    self_p = &foo;
+    value = 0;
+    ml_log_object_module_init(NULL);
+    ml_log_object_init(&self_p->log_object, "foo", ML_LOG_INFO);
+
+    CAPTURE_OUTPUT(output, errput) {
+        ML_DEBUG("bar %d", next_value(&value));
+        ML_HEXDUMP(ML_LOG_DEBUG, "1", next_value(&value));
+        ML_INFO("fie %d", next_value(&value));
+        ML_HEXDUMP(ML_LOG_INFO, "1", next_value(&value));
+    }
+
+    ASSERT_EQ(value, 2);
+    ASSERT_NOT_SUBSTRING(output, "bar");
+    ASSERT_SUBSTRING(output, " INFO foo fie 1\n");
+    ASSERT_SUBSTRING(output, " INFO foo 00000000: 31 ");
+}
+
+TEST(macros_evaluate_log_object_once)
+{
+    struct ml_log_object_t log_object;
+    struct ml_log_object_t *log_object_p;
+
+    ml_log_object_module_init(NULL);
+    ml_log_object_init(&log_object, "foo", ML_LOG_INFO);
+    log_object_p = &log_object;
+
+    CAPTURE_OUTPUT(output, errput) {
+        ML_LOG_OBJECT_PRINT(log_object_p++, ML_LOG_INFO, "bar");
+        log_object_p = &log_object;
+        ML_LOG_OBJECT_HEXDUMP(log_object_p++, ML_LOG_DEBUG, "1", 1);
+    }
+
+    ASSERT_EQ(log_object_p, &log_object + 1);
+    ASSERT_SUBSTRING(output, " INFO foo bar\n");
+}
+
+TEST(default_macros_evaluate_arguments_only_if_enabled)
+{
+    int value;
+
+    value = 0;
+    ml_log_object_module_init(NULL);
+    ml_log_object_init(&ml_log_default_object, "default", ML_LOG_INFO);
+
+    CAPTURE_OUTPUT(output, errput) {
+        ml_debug("bar %d", next_value(&value));
+        ml_info("fie %d", next_value(&value));
+        ml_log_set_level(ML_LOG_DEBUG);
+        ml_debug("fum %d", next_value(&value));
+    }
+
+    ASSERT_EQ(value, 2);
+    ASSERT_NOT_SUBSTRING(output, "bar");
+    ASSERT_SUBSTRING(output, " INFO default fie 1\n");
+    ASSERT_SUBSTRING(output, " DEBUG default fum 2\n");
+}
+
 TEST(load)
 {
     FILE *file_p;
@@ -212,3 +318,147 @@ TEST(hexdump)
         "DEBUG foo 00000010: "
         "20                                              ' '\n");
 }
+
+static void *async_main(void *arg_p)
+{
+    ml_log_object_print(arg_p, ML_LOG_INFO, "from thread");
+
+    return (NULL);
+}
+
+TEST(async)
+{
+    struct ml_log_object_t log_object;
+    pthread_t pthread;
+    int i;
+
+    ml_log_object_module_init(NULL);
+    ml_log_object_module_start_writer();
+    ml_log_object_init(&log_object, "foo", ML_LOG_INFO);
+
+    CAPTURE_OUTPUT(output, errput) {
+        for (i = 0; i < 200; i++) {
+            ml_log_object_print(&log_object, ML_LOG_INFO, "entry %d", i);
+        }
+
+        ml_log_object_print(&log_object, ML_LOG_DEBUG, "not printed");
+        ASSERT_EQ(pthread_create(&pthread, NULL, async_main, &log_object), 0);
+        ASSERT_EQ(pthread_join(pthread, NULL), 0);
+        ml_log_object_flush();
+    }
+
+    ASSERT_SUBSTRING(output, " INFO foo entry 0\n");
+    ASSERT_SUBSTRING(output, " INFO foo entry 199\n");
+    ASSERT_SUBSTRING(output, " INFO foo from thread\n");
+    ASSERT_NOT_SUBSTRING(output, "not printed");
+}
+
+TEST(binary)
+{
+    struct ml_log_object_t log_object;
+    char *output_p;
+    size_t size;
+    FILE *file_p;
+    char buf[8];
+
+    ml_log_object_module_init(NULL);
+    ml_log_object_module_start_binary(4096);
+    ml_log_object_init(&log_object, "foo", ML_LOG_INFO);
+
+    memset(&buf[0], 'a', sizeof(buf));
+    ml_log_object_print(&log_object,
+                        ML_LOG_INFO,
+                        "a %d %u 0x%04x%%",
+                        -1,
+                        2,
+                        3);
+    ml_log_object_print(&log_object, ML_LOG_WARNING, "b %hhd %ld", 300, -5L);
+    ml_log_object_print(&log_object,
+                        ML_LOG_INFO,
+                        "c %s '%.*s'",
+                        "x",
+                        3,
+                        &buf[0]);
+    ml_log_object_print(&log_object,
+                        ML_LOG_INFO,
+                        "d %5.2f %c %*d",
+                        1.5,
+                        'q',
+                        4,
+                        7);
+    ml_log_object_print(&log_object,
+                        ML_LOG_INFO,
+                        "e %zu %lld",
+                        (size_t)9,
+                        -8LL);
+    ml_log_object_print(&log_object, ML_LOG_DEBUG, "not printed");
+
+    file_p = open_memstream(&output_p, &size);
+    ml_log_object_binary_render(file_p);
+    fclose(file_p);
+
+    ASSERT_SUBSTRING(output_p, " INFO foo a -1 2 0x0003%\n");
+    ASSERT_SUBSTRING(output_p, " WARNING foo b 44 -5\n");
+    ASSERT_SUBSTRING(output_p, " INFO foo c x 'aaa'\n");
+    ASSERT_SUBSTRING(output_p, " INFO foo d  1.50 q    7\n");
+    ASSERT_SUBSTRING(output_p, " INFO foo e 9 -8\n");
+    ASSERT_NOT_SUBSTRING(output_p, "not printed");
+    free(output_p);
+}
+
+TEST(binary_wrap_around)
+{
+    struct ml_log_object_t log_object;
+    char *output_p;
+    size_t size;
+    FILE *file_p;
+    int i;
+
+    ml_log_object_module_init(NULL);
+    ml_log_object_module_start_binary(1024);
+    ml_log_object_init(&log_object, "foo", ML_LOG_INFO);
+
+    for (i = 0; i < 1000; i++) {
+        ml_log_object_print(&log_object, ML_LOG_INFO, "entry %d", i);
+    }
+
+    file_p = open_memstream(&output_p, &size);
+    ml_log_object_binary_render(file_p);
+    fclose(file_p);
+
+    ASSERT_NOT_SUBSTRING(output_p, " INFO foo entry 0\n");
+    ASSERT_SUBSTRING(output_p, " INFO foo entry 998\n");
+    ASSERT_SUBSTRING(output_p, " INFO foo entry 999\n");
+    free(output_p);
+}
+
+TEST(hexdump_many_lines)
+{
+    struct ml_log_object_t log_object;
+    uint8_t buf[1000];
+    size_t i;
+
+    ml_log_object_module_init(NULL);
+    ml_log_object_init(&log_object, "foo", ML_LOG_INFO);
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)i;
+    }
+
+    CAPTURE_OUTPUT(output, errput) {
+        ml_log_object_hexdump(&log_object, ML_LOG_INFO, &buf[0], sizeof(buf));
+    }
+
+    ASSERT_SUBSTRING(
+        output,
+        " INFO foo 00000000: "
+        "00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f '................'\n");
+    ASSERT_SUBSTRING(
+        output,
+        " INFO foo 00000040: "
+        "40 41 42 43 44 45 46 47 48 49 4a 4b 4c 4d 4e 4f '@ABCDEFGHIJKLMNO'\n");
+    ASSERT_SUBSTRING(
+        output,
+        " INFO foo 000003e0: "
+        "e0 e1 e2 e3 e4 e5 e6 e7                         '........'\n");
+}
@@ -26,6 +26,7 @@
  * This file is part of the Monolinux C library project.
  */
 
+#include <string.h>
 #include <unistd.h>
 #include "nala.h"
 #include "ml/ml.h"
@@ -59,3 +60,119 @@ TEST(on_free)
     ml_message_free(message_p);
     ASSERT_EQ(on_free_count, 1);
 }
+
+TEST(size_classes)
+{
+    void *message_1_p;
+    void *message_2_p;
+    size_t sizes[] = { 0, 1, 16, 17, 64, 200, 256, 1024, 1025, 5000 };
+    size_t i;
+
+    for (i = 0; i < membersof(sizes); i++) {
+        message_1_p = ml_message_alloc(&m1, sizes[i]);
+        ASSERT_NE(message_1_p, NULL);
+        memset(message_1_p, 0xa5, sizes[i]);
+        ml_message_free(message_1_p);
+    }
+
+    /* Small messages are reused from the thread cache. */
+    message_1_p = ml_message_alloc(&m1, 10);
+    ml_message_free(message_1_p);
+    message_2_p = ml_message_alloc(&m1, 16);
+    ASSERT_EQ(message_2_p, message_1_p);
+    ml_message_free(message_2_p);
+}
+
+static void *alloc_free_main(void *arg_p)
+{
+    void **messages_p;
+    void *messages[100];
+    int i;
+    int j;
+
+    /* Free messages allocated by another thread. */
+    messages_p = (void **)arg_p;
+
+    if (messages_p != NULL) {
+        for (i = 0; i < 100; i++) {
+            ml_message_free(messages_p[i]);
+        }
+    }
+
+    for (i = 0; i < 100; i++) {
+        for (j = 0; j < 100; j++) {
+            messages[j] = ml_message_alloc(&m1, (size_t)(j * 11));
+            memset(messages[j], j, (size_t)(j * 11));
+        }
+
+        for (j = 0; j < 100; j++) {
+            ml_message_free(messages[j]);
+        }
+    }
+
+    return (NULL);
+}
+
+TEST(alloc_free_multiple_threads)
+{
+    pthread_t pthreads[4];
+    void *messages[4][100];
+    int i;
+    int j;
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 100; j++) {
+            messages[i][j] = ml_message_alloc(&m1, (size_t)j);
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        pthread_create(&pthreads[i], NULL, alloc_free_main, &messages[i][0]);
+    }
+
+    for (i = 0; i < 4; i++) {
+        pthread_join(pthreads[i], NULL);
+    }
+
+    alloc_free_main(NULL);
+}
+
+static void *share_free_main(void *arg_p)
+{
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        ml_message_share(arg_p, 2);
+        ml_message_free(arg_p);
+        ml_message_free(arg_p);
+    }
+
+    ml_message_free(arg_p);
+
+    return (NULL);
+}
+
+TEST(share_and_free_multiple_threads)
+{
+    pthread_t pthreads[4];
+    int *value_p;
+    int i;
+
+    on_free_count = 0;
+    value_p = ml_message_alloc(&m1, sizeof(*value_p));
+    *value_p = 5;
+    ml_message_set_on_free(value_p, on_free_cb);
+    ml_message_share(value_p, 4);
+
+    for (i = 0; i < 4; i++) {
+        pthread_create(&pthreads[i], NULL, share_free_main, value_p);
+    }
+
+    ml_message_free(value_p);
+
+    for (i = 0; i < 4; i++) {
+        pthread_join(pthreads[i], NULL);
+    }
+
+    ASSERT_EQ(on_free_count, 1);
+}
@@ -26,7 +26,11 @@
  * This file is part of the Monolinux C library project.
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include "nala.h"
 #include "ml/ml.h"
 
@@ -173,3 +177,345 @@ TEST(queue_on_put)
 
     ml_queue_destroy(&queue_1);
 }
+
+struct producer_message_t {
+    int producer;
+    int index;
+};
+
+static void *multiple_producers_main(void *arg_p)
+{
+    struct producer_message_t *message_p;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        message_p = ml_message_alloc(&m1, sizeof(*message_p));
+        message_p->producer = (int)(uintptr_t)arg_p;
+        message_p->index = i;
+        ml_queue_put(&queue, message_p);
+    }
+
+    return (NULL);
+}
+
+TEST(multiple_producers)
+{
+    struct producer_message_t *message_p;
+    pthread_t pthreads[4];
+    int indexes[4];
+    int i;
+
+    ml_queue_init(&queue, 8);
+
+    for (i = 0; i < 4; i++) {
+        indexes[i] = 0;
+        pthread_create(&pthreads[i],
+                       NULL,
+                       multiple_producers_main,
+                       (void *)(uintptr_t)i);
+    }
+
+    /* Messages from each producer are received in order. */
+    for (i = 0; i < 4000; i++) {
+        ASSERT_EQ(ml_queue_get(&queue, (void **)&message_p), &m1);
+        ASSERT_EQ(message_p->index, indexes[message_p->producer]);
+        indexes[message_p->producer]++;
+        ml_message_free(message_p);
+    }
+
+    for (i = 0; i < 4; i++) {
+        pthread_join(pthreads[i], NULL);
+        ASSERT_EQ(indexes[i], 1000);
+    }
+
+    ml_queue_destroy(&queue);
+}
+
+TEST(put_many_get_many)
+{
+    void *messages[5];
+    void *got_messages[4];
+    struct ml_uid_t *uids[4];
+    int i;
+
+    ml_queue_init(&queue, 8);
+
+    for (i = 0; i < 5; i++) {
+        messages[i] = ml_message_alloc(i % 2 == 0 ? &m1 : &m2, 0);
+    }
+
+    ml_queue_put_many(&queue, &messages[0], 5);
+
+    /* At most four messages at a time. */
+    ASSERT_EQ(ml_queue_get_many(&queue, &uids[0], &got_messages[0], 4, -1), 4);
+
+    for (i = 0; i < 4; i++) {
+        ASSERT_EQ(uids[i], i % 2 == 0 ? &m1 : &m2);
+        ASSERT_EQ(got_messages[i], messages[i]);
+        ml_message_free(got_messages[i]);
+    }
+
+    ASSERT_EQ(ml_queue_get_many(&queue, &uids[0], &got_messages[0], 4, 0), 1);
+    ASSERT_EQ(uids[0], &m1);
+    ASSERT_EQ(got_messages[0], messages[4]);
+    ml_message_free(got_messages[0]);
+
+    /* Empty queue. */
+    ASSERT_EQ(ml_queue_get_many(&queue, &uids[0], &got_messages[0], 4, 0), 0);
+    ASSERT_EQ(ml_queue_get_many(&queue, &uids[0], &got_messages[0], 4, 10), 0);
+
+    ml_queue_destroy(&queue);
+}
+
+TEST(put_many_get_many_large_batches)
+{
+    void *messages[200];
+    void *got_messages[200];
+    struct ml_uid_t *uids[200];
+    int i;
+
+    ml_queue_init(&queue, 256);
+
+    for (i = 0; i < 200; i++) {
+        messages[i] = ml_message_alloc(&m1, 0);
+    }
+
+    /* Nothing to put or get. */
+    ml_queue_put_many(&queue, &messages[0], 0);
+    ASSERT_EQ(ml_queue_get_many(&queue, &uids[0], &got_messages[0], 0, 0), 0);
+    ASSERT_EQ(ml_queue_get_many(&queue, &uids[0], &got_messages[0], -1, 0),
+              0);
+
+    /* More messages than fits in one batch. */
+    ml_queue_put_many(&queue, &messages[0], 200);
+    ASSERT_EQ(ml_queue_get_many(&queue, &uids[0], &got_messages[0], 150, -1),
+              150);
+    ASSERT_EQ(ml_queue_get_many(&queue,
+                                &uids[150],
+                                &got_messages[150],
+                                150,
+                                0),
+              50);
+
+    for (i = 0; i < 200; i++) {
+        ASSERT_EQ(uids[i], &m1);
+        ASSERT_EQ(got_messages[i], messages[i]);
+        ml_message_free(got_messages[i]);
+    }
+
+    ml_queue_destroy(&queue);
+}
+
+static void *put_many_full_main(void *arg_p)
+{
+    (void)arg_p;
+
+    void *messages[10];
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        messages[i] = ml_message_alloc(&m1, sizeof(int));
+        *(int *)messages[i] = i;
+    }
+
+    /* Blocks until the test has made room for all messages. */
+    ml_queue_put_many(&queue_1, &messages[0], 10);
+
+    return (NULL);
+}
+
+TEST(put_many_full)
+{
+    void *messages[3];
+    struct ml_uid_t *uids[3];
+    pthread_t pthread;
+    int count;
+    int i;
+    int j;
+
+    ml_queue_init(&queue_1, 4);
+    pthread_create(&pthread, NULL, put_many_full_main, NULL);
+    i = 0;
+
+    while (i < 10) {
+        count = ml_queue_get_many(&queue_1, &uids[0], &messages[0], 3, -1);
+        ASSERT_GT(count, 0);
+
+        for (j = 0; j < count; j++) {
+            ASSERT_EQ(*(int *)messages[j], i);
+            ml_message_free(messages[j]);
+            i++;
+        }
+    }
+
+    pthread_join(pthread, NULL);
+    ml_queue_destroy(&queue_1);
+}
+
+static void on_put_eventfd(void *arg_p)
+{
+    uint64_t value;
+
+    value = 1;
+    ASSERT_EQ(write(*(int *)arg_p, &value, sizeof(value)), sizeof(value));
+}
+
+TEST(put_many_full_on_put)
+{
+    struct pollfd fds;
+    void *message_p;
+    uint64_t value;
+    pthread_t pthread;
+    int fd;
+    int i;
+
+    fd = eventfd(0, EFD_NONBLOCK);
+    ASSERT_GE(fd, 0);
+    ml_queue_init(&queue_1, 4);
+    ml_queue_set_on_put(&queue_1, on_put_eventfd, &fd);
+    pthread_create(&pthread, NULL, put_many_full_main, NULL);
+    i = 0;
+
+    /* Only get messages when notified by the callback. */
+    while (i < 10) {
+        fds.fd = fd;
+        fds.events = POLLIN;
+        ASSERT_EQ(poll(&fds, 1, 5000), 1);
+        ASSERT_EQ(read(fd, &value, sizeof(value)), sizeof(value));
+
+        while (ml_queue_try_get(&queue_1, &message_p) != NULL) {
+            ASSERT_EQ(*(int *)message_p, i);
+            ml_message_free(message_p);
+            i++;
+        }
+    }
+
+    pthread_join(pthread, NULL);
+    ml_queue_destroy(&queue_1);
+    close(fd);
+}
+
+TEST(try_get_and_try_put)
+{
+    void *message_1_p;
+    void *message_2_p;
+    void *message_3_p;
+    void *message_p;
+
+    ml_queue_init(&queue, 2);
+
+    /* Empty queue. */
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), NULL);
+
+    /* Fill the queue. */
+    message_1_p = ml_message_alloc(&m1, 0);
+    ASSERT_EQ(ml_queue_try_put(&queue, message_1_p), 0);
+    message_2_p = ml_message_alloc(&m2, 0);
+    ASSERT_EQ(ml_queue_try_put(&queue, message_2_p), 0);
+
+    /* Full queue. The message is still owned by the caller. */
+    message_3_p = ml_message_alloc(&m1, 0);
+    ASSERT_EQ(ml_queue_try_put(&queue, message_3_p), -EAGAIN);
+    ml_message_free(message_3_p);
+
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), &m1);
+    ASSERT_EQ(message_p, message_1_p);
+    ml_message_free(message_p);
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), &m2);
+    ASSERT_EQ(message_p, message_2_p);
+    ml_message_free(message_p);
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), NULL);
+
+    ml_queue_destroy(&queue);
+}
+
+static float elapsed_ms(struct timespec *start_p)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((now.tv_sec - start_p->tv_sec) * 1000.0f
+            + (now.tv_nsec - start_p->tv_nsec) / 1000000.0f);
+}
+
+TEST(get_and_put_timeout)
+{
+    struct timespec start;
+    void *message_1_p;
+    void *message_2_p;
+    void *message_3_p;
+    void *message_p;
+
+    ml_queue_init(&queue, 2);
+
+    /* Get from an empty queue times out. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT_EQ(ml_queue_get_timeout(&queue, &message_p, 20), NULL);
+    ASSERT_GE(elapsed_ms(&start), 20.0f);
+
+    message_1_p = ml_message_alloc(&m1, 0);
+    ASSERT_EQ(ml_queue_put_timeout(&queue, message_1_p, 20), 0);
+    message_2_p = ml_message_alloc(&m2, 0);
+    ASSERT_EQ(ml_queue_put_timeout(&queue, message_2_p, 20), 0);
+
+    /* Put on a full queue times out. */
+    message_3_p = ml_message_alloc(&m1, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT_EQ(ml_queue_put_timeout(&queue, message_3_p, 20), -ETIMEDOUT);
+    ASSERT_GE(elapsed_ms(&start), 20.0f);
+    ml_message_free(message_3_p);
+
+    ASSERT_EQ(ml_queue_get_timeout(&queue, &message_p, 20), &m1);
+    ASSERT_EQ(message_p, message_1_p);
+    ml_message_free(message_p);
+    ASSERT_EQ(ml_queue_get_timeout(&queue, &message_p, -1), &m2);
+    ASSERT_EQ(message_p, message_2_p);
+    ml_message_free(message_p);
+
+    ml_queue_destroy(&queue);
+}
+
+TEST(poll_fd)
+{
+    struct pollfd fds[1];
+    void *message_1_p;
+    void *message_2_p;
+    void *message_p;
+
+    ml_queue_init(&queue, 4);
+
+    /* A message put before the file descriptor is created. */
+    message_1_p = ml_message_alloc(&m1, 0);
+    ml_queue_put(&queue, message_1_p);
+
+    fds[0].fd = ml_queue_get_fd(&queue);
+    ASSERT_NE(fds[0].fd, -1);
+    ASSERT_EQ(ml_queue_get_fd(&queue), fds[0].fd);
+    fds[0].events = POLLIN;
+
+    /* Readable as long as the queue is not empty. */
+    ASSERT_EQ(poll(&fds[0], 1, 0), 1);
+    message_2_p = ml_message_alloc(&m2, 0);
+    ml_queue_put(&queue, message_2_p);
+    ASSERT_EQ(poll(&fds[0], 1, 0), 1);
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), &m1);
+    ml_message_free(message_p);
+    ASSERT_EQ(poll(&fds[0], 1, 0), 1);
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), &m2);
+    ml_message_free(message_p);
+
+    /* Not readable when empty. */
+    ASSERT_EQ(poll(&fds[0], 1, 0), 0);
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), NULL);
+
+    /* Readable again after a put. */
+    message_1_p = ml_message_alloc(&m1, 0);
+    ml_queue_put(&queue, message_1_p);
+    ASSERT_EQ(poll(&fds[0], 1, 0), 1);
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), &m1);
+    ml_message_free(message_p);
+    ASSERT_EQ(poll(&fds[0], 1, 0), 0);
+
+    ml_queue_destroy(&queue);
+}
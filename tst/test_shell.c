@@ -1866,6 +1866,7 @@ TEST(log_store)
               "       log store\n"
               "       log print <message>\n"
               "       log print <level> <message>\n"
+              "       log binary [<dump-file>]\n"
               "ERROR(-2: No such file or directory)\n"
               "$ exit\n");
 }
@@ -1876,8 +1877,8 @@ TEST(log_print)
 
     fd = init_and_start();
 
-    ml_log_object_vprint_mock_once(ML_LOG_INFO, "hello");
-    ml_log_object_vprint_mock_once(ML_LOG_ERROR, "hi");
+    ml_log_object_vprint_mock_once(ML_LOG_INFO, "%s");
+    ml_log_object_vprint_mock_once(ML_LOG_ERROR, "%s");
 
     CAPTURE_OUTPUT(output, errput) {
         input(fd, "log print hello\n");
@@ -1893,3 +1894,25 @@ TEST(log_print)
               "OK\n"
               "$ exit\n");
 }
+
+TEST(log_print_binary)
+{
+    int fd;
+
+    ml_log_object_module_init(NULL);
+    ml_log_object_module_start_binary(4096);
+    ml_log_object_init(&ml_log_default_object, "default", ML_LOG_INFO);
+    fd = init_and_start();
+
+    /* The messages are rendered after the line buffer is reused. */
+    CAPTURE_OUTPUT(output, errput) {
+        input(fd, "log print hello%s\n");
+        input(fd, "log print error hi\n");
+        input(fd, "log binary\n");
+        input(fd, "exit\n");
+        ml_shell_join();
+    }
+
+    ASSERT_SUBSTRING(output, " INFO default hello%s\n");
+    ASSERT_SUBSTRING(output, " ERROR default hi\n");
+}
@@ -26,8 +26,14 @@
  * This file is part of the Monolinux C library project.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include "nala.h"
 #include "ml/ml.h"
 
@@ -73,6 +79,45 @@ TEST(periodic)
     ml_timer_stop(&timer);
 }
 
+TEST(periodic_with_lagging_consumer)
+{
+    struct ml_timer_t timer;
+    struct ml_queue_t queue;
+    struct ml_uid_t *uid_p;
+    struct ml_timer_timeout_message_t *message_p;
+
+    ml_init();
+    ml_queue_init(&queue, 1);
+    ml_timer_init(&timer, &timeout, &queue);
+    ml_timer_start(&timer, 1, 1);
+
+    /* Let the queue fill up and the handler fall behind, so it has
+       many timeouts to deliver. Stopping the timer must not wait for
+       the handler. */
+    usleep(50000);
+    ml_timer_stop(&timer);
+
+    /* All timeouts sent before the timer was stopped are invalid. */
+    while (true) {
+        uid_p = ml_queue_get_timeout(&queue, (void **)&message_p, 100);
+
+        if (uid_p == NULL) {
+            break;
+        }
+
+        ASSERT_EQ(uid_p, &timeout);
+        ASSERT_EQ(ml_timer_is_message_valid(&timer), false);
+        ml_message_free(message_p);
+    }
+
+    /* Still works. */
+    ml_timer_start(&timer, 1, 0);
+    uid_p = ml_queue_get(&queue, (void **)&message_p);
+    ASSERT_EQ(uid_p, &timeout);
+    ASSERT_EQ(ml_timer_is_message_valid(&timer), true);
+    ml_message_free(message_p);
+}
+
 TEST(is_message_valid)
 {
     struct ml_timer_t timer;
@@ -183,3 +228,305 @@ TEST(multiple_timers)
         ml_message_free(message_p);
     }
 }
+
+TEST(many_timers)
+{
+    struct ml_timer_t timers[1000];
+    struct ml_queue_t queue;
+    struct ml_uid_t *uid_p;
+    struct ml_timer_timeout_message_t *message_p;
+    int i;
+
+    ml_init();
+    ml_queue_init(&queue, 1);
+
+    /* Timeouts from zero(0) to about 17 minutes. */
+    for (i = 0; i < 1000; i++) {
+        ml_timer_init(&timers[i], &timeout, &queue);
+        ml_timer_start(&timers[i], 1000 * i, 0);
+    }
+
+    for (i = 1; i < 1000; i += 2) {
+        ml_timer_stop(&timers[i]);
+    }
+
+    uid_p = ml_queue_get(&queue, (void **)&message_p);
+    ASSERT_EQ(uid_p, &timeout);
+    ASSERT_EQ(ml_timer_is_message_valid(&timers[0]), true);
+    ml_message_free(message_p);
+
+    for (i = 2; i < 1000; i += 2) {
+        ml_timer_stop(&timers[i]);
+    }
+
+    /* Nothing more expires. */
+    usleep(300000);
+    ASSERT_EQ(ml_queue_try_get(&queue, (void **)&message_p), NULL);
+}
+
+TEST(millisecond_resolution)
+{
+    struct ml_timer_t timer;
+    struct ml_queue_t queue;
+    struct ml_uid_t *uid_p;
+    struct ml_timer_timeout_message_t *message_p;
+    struct timespec start;
+    struct timespec end;
+    long elapsed;
+
+    ml_init();
+    ml_queue_init(&queue, 1);
+    ml_timer_init(&timer, &timeout, &queue);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ml_timer_start(&timer, 20, 0);
+    uid_p = ml_queue_get(&queue, (void **)&message_p);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT_EQ(uid_p, &timeout);
+    ASSERT_EQ(ml_timer_is_message_valid(&timer), true);
+    ml_message_free(message_p);
+    elapsed = ((end.tv_sec - start.tv_sec) * 1000
+               + (end.tv_nsec - start.tv_nsec) / 1000000);
+    ASSERT_GE(elapsed, 20);
+    ASSERT_LT(elapsed, 100);
+}
+
+TEST(boottime_handler)
+{
+    struct ml_timer_handler_t handler;
+    struct ml_bus_t bus;
+    struct ml_timer_t timer;
+    struct ml_queue_t queue;
+    struct ml_uid_t *uid_p;
+    struct ml_timer_timeout_message_t *message_p;
+
+    ml_bus_init(&bus);
+    ml_timer_handler_init_clock(&handler, CLOCK_BOOTTIME, &bus);
+    ml_queue_init(&queue, 1);
+    ml_timer_handler_timer_init(&handler, &timer, &timeout, &queue);
+    ml_timer_handler_timer_start(&timer, 10, 0);
+    uid_p = ml_queue_get(&queue, (void **)&message_p);
+    ASSERT_EQ(uid_p, &timeout);
+    ASSERT_EQ(ml_timer_is_message_valid(&timer), true);
+    ml_message_free(message_p);
+}
+
+TEST(embedded_periodic)
+{
+    struct ml_timer_t timer;
+    struct ml_queue_t queue;
+    struct ml_uid_t *uid_p;
+    void *message_p;
+    void *first_message_p;
+    int i;
+
+    ml_init();
+    ml_queue_init(&queue, 1);
+    ml_timer_init_embedded(&timer, &timeout, &queue);
+    ml_timer_start(&timer, 1, 1);
+    first_message_p = NULL;
+
+    for (i = 0; i < 10; i++) {
+        uid_p = ml_queue_get(&queue, &message_p);
+        ASSERT_EQ(uid_p, &timeout);
+
+        /* Always the same token. */
+        if (first_message_p == NULL) {
+            first_message_p = message_p;
+        }
+
+        ASSERT_EQ(message_p, first_message_p);
+        ASSERT_EQ(ml_timer_take_expiry(message_p), true);
+        ml_message_free(message_p);
+    }
+
+    ml_timer_stop(&timer);
+}
+
+TEST(embedded_stale_expiry)
+{
+    struct ml_timer_t timer;
+    struct ml_queue_t queue;
+    struct ml_uid_t *uid_p;
+    void *message_p;
+
+    ml_init();
+    ml_queue_init(&queue, 1);
+    ml_timer_init_embedded(&timer, &timeout, &queue);
+
+    /* Stopped after expiry. */
+    ml_timer_start(&timer, 0, 0);
+    uid_p = ml_queue_get(&queue, &message_p);
+    ml_timer_stop(&timer);
+    ASSERT_EQ(uid_p, &timeout);
+    ASSERT_EQ(ml_timer_take_expiry(message_p), false);
+
+    /* Restarted after expiry, and then expires again. */
+    ml_timer_start(&timer, 0, 0);
+    usleep(50000);
+    ml_timer_start(&timer, 0, 0);
+    uid_p = ml_queue_get(&queue, &message_p);
+    ASSERT_EQ(uid_p, &timeout);
+
+    if (!ml_timer_take_expiry(message_p)) {
+        uid_p = ml_queue_get(&queue, &message_p);
+        ASSERT_EQ(uid_p, &timeout);
+        ASSERT_EQ(ml_timer_take_expiry(message_p), true);
+    }
+
+    ASSERT_EQ(ml_queue_try_get(&queue, &message_p), NULL);
+}
+
+static void *timers_in_multiple_threads_main(void *arg_p)
+{
+    struct ml_timer_t *timer_p;
+    struct ml_queue_t queue;
+    void *message_p;
+    int i;
+
+    timer_p = (struct ml_timer_t *)arg_p;
+    ml_queue_init(&queue, 1);
+    ml_timer_init(timer_p, &timeout, &queue);
+
+    for (i = 0; i < 5; i++) {
+        ml_timer_start(timer_p, 5, 0);
+
+        if (ml_queue_get(&queue, &message_p) != &timeout) {
+            return (NULL);
+        }
+
+        if (!ml_timer_is_message_valid(timer_p)) {
+            return (NULL);
+        }
+
+        ml_message_free(message_p);
+    }
+
+    return (timer_p);
+}
+
+static void read_clock_jump_callback(int fd, void *buf, size_t nbytes)
+{
+    eventfd_t value;
+
+    (void)buf;
+    (void)nbytes;
+
+    /* Make the file descriptor unreadable, as a cancelled timer file
+       descriptor is once read. */
+    ASSERT_EQ(eventfd_read(fd, &value), 0);
+}
+
+static void read_real_callback(int fd, void *buf, size_t nbytes)
+{
+    ASSERT_EQ(syscall(SYS_read, fd, buf, nbytes), (long)nbytes);
+}
+
+static void timerfd_settime_real_callback(int ufd,
+                                          int flags,
+                                          const struct itimerspec *utmr,
+                                          struct itimerspec *otmr)
+{
+    ASSERT_EQ(syscall(SYS_timerfd_settime, ufd, flags, utmr, otmr), 0);
+}
+
+TEST(clock_jump)
+{
+    struct ml_timer_handler_t handler;
+    struct ml_bus_t bus;
+    struct ml_timer_t timer;
+    struct ml_queue_t queue;
+    struct ml_uid_t *uid_p;
+    void *message_p;
+    struct itimerspec clock_jump_timeout;
+    int timer_fd;
+    int clock_jump_fd;
+
+    timer_fd = (int)syscall(SYS_timerfd_create, CLOCK_MONOTONIC, 0);
+    ASSERT_NE(timer_fd, -1);
+
+    /* Readable at once, as a realtime timer file descriptor cancelled
+       by setting the realtime clock. */
+    clock_jump_fd = eventfd(1, 0);
+    ASSERT_NE(clock_jump_fd, -1);
+
+    clock_jump_timeout.it_value.tv_sec = LONG_MAX;
+    clock_jump_timeout.it_value.tv_nsec = 0;
+    clock_jump_timeout.it_interval.tv_sec = 0;
+    clock_jump_timeout.it_interval.tv_nsec = 0;
+
+    timerfd_create_mock_once(CLOCK_MONOTONIC, 0, timer_fd);
+    timerfd_create_mock_once(CLOCK_REALTIME, 0, clock_jump_fd);
+
+    /* Armed when initialized, and re-armed after the clock jump. */
+    timerfd_settime_mock_once(clock_jump_fd,
+                              TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                              0);
+    timerfd_settime_mock_set_new_value_in(&clock_jump_timeout,
+                                          sizeof(clock_jump_timeout));
+    read_mock_once(clock_jump_fd, sizeof(uint64_t), -1);
+    read_mock_set_errno(ECANCELED);
+    read_mock_set_callback(read_clock_jump_callback);
+    timerfd_settime_mock_once(clock_jump_fd,
+                              TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                              0);
+    timerfd_settime_mock_set_new_value_in(&clock_jump_timeout,
+                                          sizeof(clock_jump_timeout));
+
+    /* The timer is armed, expires and the handler is disarmed. */
+    timerfd_settime_mock_once(timer_fd, TFD_TIMER_ABSTIME, 0);
+    timerfd_settime_mock_set_callback(timerfd_settime_real_callback);
+    read_mock_once(timer_fd, sizeof(uint64_t), sizeof(uint64_t));
+    read_mock_set_callback(read_real_callback);
+    timerfd_settime_mock_once(timer_fd, TFD_TIMER_ABSTIME, 0);
+    timerfd_settime_mock_set_callback(timerfd_settime_real_callback);
+
+    ml_bus_init(&bus);
+    ml_queue_init(&queue, 1);
+    ml_bus_subscribe(&bus, &queue, &ml_timer_clock_jump);
+    ml_timer_handler_init_clock(&handler, CLOCK_MONOTONIC, &bus);
+
+    uid_p = ml_queue_get(&queue, &message_p);
+    ASSERT_EQ(uid_p, &ml_timer_clock_jump);
+    ml_message_free(message_p);
+
+    /* Timers still expire after the clock jump. */
+    ml_timer_handler_timer_init(&handler, &timer, &timeout, &queue);
+    ml_timer_handler_timer_start(&timer, 10, 0);
+    uid_p = ml_queue_get(&queue, &message_p);
+    ASSERT_EQ(uid_p, &timeout);
+    ASSERT_EQ(ml_timer_is_message_valid(&timer), true);
+    ml_message_free(message_p);
+}
+
+TEST(timers_in_multiple_threads)
+{
+    struct ml_timer_t timers[4];
+    pthread_t threads[4];
+    void *res_p;
+    int i;
+
+    ml_init();
+
+    for (i = 0; i < 4; i++) {
+        pthread_create(&threads[i],
+                       NULL,
+                       timers_in_multiple_threads_main,
+                       &timers[i]);
+    }
+
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], &res_p);
+        ASSERT_EQ(res_p, &timers[i]);
+    }
+
+    /* Threads are spread over the handlers. */
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        for (i = 1; i < 4; i++) {
+            if (timers[i].handler_p != timers[0].handler_p) {
+                break;
+            }
+        }
+
+        ASSERT_LT(i, 4);
+    }
+}
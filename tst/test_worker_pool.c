@@ -26,6 +26,10 @@
  * This file is part of the Monolinux C library project.
  */
 
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include "nala.h"
 #include "ml/ml.h"
@@ -58,3 +62,671 @@ TEST(full)
         ml_message_free(message_p);
     }
 }
+
+static atomic_int number_of_leaves;
+
+static void test_recursive_entry(void *arg_p)
+{
+    intptr_t depth;
+
+    depth = (intptr_t)arg_p;
+
+    if (depth == 0) {
+        if (atomic_fetch_add(&number_of_leaves, 1) == 1023) {
+            ml_queue_put(&queue, ml_message_alloc(&mid, 0));
+        }
+    } else {
+        ml_worker_pool_spawn(&worker_pool,
+                             test_recursive_entry,
+                             (void *)(depth - 1));
+        ml_worker_pool_spawn(&worker_pool,
+                             test_recursive_entry,
+                             (void *)(depth - 1));
+    }
+}
+
+TEST(spawn_from_workers)
+{
+    void *message_p;
+    int i;
+
+    ml_queue_init(&queue, 1);
+    ml_worker_pool_init(&worker_pool, 4, 10);
+    ASSERT_EQ(worker_pool.number_of_workers, 4);
+
+    for (i = 0; i < 4; i++) {
+        ASSERT_NE(worker_pool.pthreads_p[i], 0);
+    }
+
+    /* A binary tree of 1024 leaf jobs. */
+    atomic_store(&number_of_leaves, 0);
+    ml_worker_pool_spawn(&worker_pool, test_recursive_entry, (void *)10);
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+    ASSERT_EQ(atomic_load(&number_of_leaves), 1024);
+}
+
+struct test_job_t {
+    struct ml_worker_pool_job_t job;
+    int value;
+};
+
+static atomic_int jobs_sum;
+
+static void test_job_entry(void *arg_p)
+{
+    struct test_job_t *job_p;
+
+    job_p = (struct test_job_t *)arg_p;
+
+    if (atomic_fetch_add(&jobs_sum, job_p->value) + job_p->value == 5050) {
+        ml_queue_put(&queue, ml_message_alloc(&mid, 0));
+    }
+}
+
+static void test_blocking_entry(void *arg_p)
+{
+    void *message_p;
+
+    ASSERT_EQ(ml_queue_get((struct ml_queue_t *)arg_p, &message_p), &mid);
+    ml_message_free(message_p);
+}
+
+TEST(spawn_job)
+{
+    struct ml_worker_pool_lane_statistics_t statistics;
+    struct test_job_t jobs[100];
+    struct ml_queue_t blocker;
+    void *message_p;
+    int i;
+
+    ml_queue_init(&queue, 1);
+    ml_queue_init(&blocker, 1);
+    ml_worker_pool_init(&worker_pool, 1, 4);
+    ml_worker_pool_set_lane_statistics(&worker_pool, true);
+    atomic_store(&jobs_sum, 0);
+
+    /* Block the only worker, so the jobs ring fills up and the
+       remaining jobs are put in the overflow list. */
+    ml_worker_pool_spawn(&worker_pool, test_blocking_entry, &blocker);
+
+    for (i = 0; i < 100; i++) {
+        jobs[i].value = (i + 1);
+        ml_worker_pool_job_init(&jobs[i].job, test_job_entry, &jobs[i]);
+        ml_worker_pool_spawn_job(&worker_pool, &jobs[i].job);
+    }
+
+    ASSERT_NE(atomic_load(&worker_pool.overflow_p), NULL);
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    ASSERT_GE(statistics.depth, 100);
+    ml_queue_put(&blocker, ml_message_alloc(&mid, 0));
+
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+    ASSERT_EQ(atomic_load(&jobs_sum), 5050);
+
+    /* Jobs moved from the overflow list to the deque are counted. */
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    ASSERT_EQ(statistics.depth, 0);
+    ASSERT_EQ(statistics.number_of_jobs, 101);
+}
+
+static atomic_int number_of_statistics_leaves;
+static unsigned int statistics_depth;
+
+static void test_statistics_leaf_entry(void *arg_p)
+{
+    (void)arg_p;
+
+    if (atomic_fetch_add(&number_of_statistics_leaves, 1) == 7) {
+        ml_queue_put(&queue, ml_message_alloc(&mid, 0));
+    }
+}
+
+static void test_statistics_entry(void *arg_p)
+{
+    struct ml_worker_pool_lane_statistics_t statistics;
+    int i;
+
+    (void)arg_p;
+
+    /* Pushed to the own deque. */
+    for (i = 0; i < 8; i++) {
+        ml_worker_pool_spawn(&worker_pool, test_statistics_leaf_entry, NULL);
+    }
+
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    statistics_depth = statistics.depth;
+}
+
+TEST(lane_statistics_of_deque_jobs)
+{
+    struct ml_worker_pool_lane_statistics_t statistics;
+    void *message_p;
+
+    ml_queue_init(&queue, 1);
+    ml_worker_pool_init(&worker_pool, 1, 4);
+    ml_worker_pool_set_lane_statistics(&worker_pool, true);
+    atomic_store(&number_of_statistics_leaves, 0);
+
+    ml_worker_pool_spawn(&worker_pool, test_statistics_entry, NULL);
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+    ASSERT_EQ(statistics_depth, 8);
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    ASSERT_EQ(statistics.depth, 0);
+    ASSERT_EQ(statistics.number_of_jobs, 9);
+
+    /* Not counted when disabled. */
+    ml_worker_pool_set_lane_statistics(&worker_pool, false);
+    atomic_store(&number_of_statistics_leaves, 0);
+    ml_worker_pool_spawn(&worker_pool, test_statistics_entry, NULL);
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    ASSERT_EQ(statistics.number_of_jobs, 9);
+}
+
+static void *test_square_entry(void *arg_p)
+{
+    intptr_t value;
+
+    value = (intptr_t)arg_p;
+
+    return ((void *)(value * value));
+}
+
+static void *test_increment_entry(void *arg_p)
+{
+    return ((void *)((intptr_t)arg_p + 1));
+}
+
+static void *test_sleep_entry(void *arg_p)
+{
+    usleep(100000);
+
+    return (arg_p);
+}
+
+TEST(futures)
+{
+    struct ml_worker_pool_future_t futures[10];
+    struct ml_worker_pool_future_t next_future;
+    struct ml_worker_pool_future_t last_future;
+    void *result_p;
+    intptr_t i;
+
+    ml_worker_pool_init(&worker_pool, 4, 4);
+
+    for (i = 0; i < 10; i++) {
+        ml_worker_pool_submit(&worker_pool,
+                              &futures[i],
+                              test_square_entry,
+                              (void *)i);
+    }
+
+    ml_worker_pool_wait_all(&futures[0], 10);
+
+    for (i = 0; i < 10; i++) {
+        ASSERT_EQ((intptr_t)ml_worker_pool_future_wait(&futures[i]), i * i);
+    }
+
+    /* Continuations, added before and after the future is done. */
+    ml_worker_pool_submit(&worker_pool,
+                          &futures[0],
+                          test_sleep_entry,
+                          (void *)5);
+    ASSERT_EQ(ml_worker_pool_future_then(&futures[0],
+                                         &next_future,
+                                         test_square_entry),
+              0);
+    ASSERT_EQ((intptr_t)ml_worker_pool_future_wait(&next_future), 25);
+    ASSERT_EQ(ml_worker_pool_future_then(&next_future,
+                                         &last_future,
+                                         test_increment_entry),
+              0);
+    ASSERT_EQ((intptr_t)ml_worker_pool_future_wait(&last_future), 26);
+
+    /* At most one continuation. */
+    ml_worker_pool_submit(&worker_pool,
+                          &futures[0],
+                          test_sleep_entry,
+                          (void *)5);
+    ASSERT_EQ(ml_worker_pool_future_then(&futures[0],
+                                         &next_future,
+                                         test_square_entry),
+              0);
+    ASSERT_EQ(ml_worker_pool_future_then(&futures[0],
+                                         &last_future,
+                                         test_increment_entry),
+              -EBUSY);
+    ASSERT_EQ((intptr_t)ml_worker_pool_future_wait(&next_future), 25);
+
+    /* Timeout. */
+    ml_worker_pool_submit(&worker_pool,
+                          &futures[0],
+                          test_sleep_entry,
+                          (void *)3);
+    ASSERT_EQ(ml_worker_pool_future_wait_timeout(&futures[0], 0, &result_p),
+              -ETIMEDOUT);
+    ASSERT_EQ(ml_worker_pool_future_wait_timeout(&futures[0], 10, &result_p),
+              -ETIMEDOUT);
+    ASSERT_EQ(ml_worker_pool_future_wait_timeout(&futures[0],
+                                                 1000,
+                                                 &result_p),
+              0);
+    ASSERT_EQ((intptr_t)result_p, 3);
+}
+
+static void *test_fork_join_entry(void *arg_p)
+{
+    struct ml_worker_pool_future_t futures[2];
+    intptr_t depth;
+
+    depth = (intptr_t)arg_p;
+
+    if (depth == 0) {
+        return ((void *)1);
+    }
+
+    ml_worker_pool_submit(&worker_pool,
+                          &futures[0],
+                          test_fork_join_entry,
+                          (void *)(depth - 1));
+    ml_worker_pool_submit(&worker_pool,
+                          &futures[1],
+                          test_fork_join_entry,
+                          (void *)(depth - 1));
+    ml_worker_pool_wait_all(&futures[0], 2);
+
+    return ((void *)((intptr_t)futures[0].result_p
+                     + (intptr_t)futures[1].result_p));
+}
+
+TEST(fork_join_in_workers)
+{
+    struct ml_worker_pool_future_t future;
+
+    ml_worker_pool_init(&worker_pool, 2, 4);
+    ml_worker_pool_submit(&worker_pool,
+                          &future,
+                          test_fork_join_entry,
+                          (void *)10);
+    ASSERT_EQ((intptr_t)ml_worker_pool_future_wait(&future), 1024);
+}
+
+static void test_parallel_for_entry(size_t begin, size_t end, void *arg_p)
+{
+    uint8_t *buf_p;
+    size_t i;
+
+    buf_p = (uint8_t *)arg_p;
+
+    for (i = begin; i < end; i++) {
+        buf_p[i]++;
+    }
+}
+
+static uint64_t test_parallel_map(size_t begin, size_t end, void *arg_p)
+{
+    uint64_t sum;
+    size_t i;
+
+    (void)arg_p;
+    sum = 0;
+
+    for (i = begin; i < end; i++) {
+        sum += i;
+    }
+
+    return (sum);
+}
+
+static uint64_t test_parallel_reduce(uint64_t left, uint64_t right)
+{
+    return (left + right);
+}
+
+TEST(parallel_for_and_reduce)
+{
+    static uint8_t buf[100000];
+    size_t i;
+
+    ml_worker_pool_init(&worker_pool, 4, 4);
+    memset(&buf[0], 0, sizeof(buf));
+
+    /* Every item exactly once. */
+    ml_parallel_for(&worker_pool,
+                    0,
+                    sizeof(buf),
+                    100,
+                    test_parallel_for_entry,
+                    &buf[0]);
+
+    for (i = 0; i < sizeof(buf); i++) {
+        ASSERT_EQ(buf[i], 1);
+    }
+
+    ml_parallel_for(&worker_pool, 10, 11, 0, test_parallel_for_entry, &buf[0]);
+    ASSERT_EQ(buf[9], 1);
+    ASSERT_EQ(buf[10], 2);
+    ASSERT_EQ(buf[11], 1);
+
+    ASSERT_EQ(ml_parallel_reduce(&worker_pool,
+                                 0,
+                                 1000000,
+                                 1000,
+                                 0,
+                                 test_parallel_map,
+                                 test_parallel_reduce,
+                                 NULL),
+              499999500000ull);
+    ASSERT_EQ(ml_parallel_reduce(&worker_pool,
+                                 5,
+                                 5,
+                                 1,
+                                 7,
+                                 test_parallel_map,
+                                 test_parallel_reduce,
+                                 NULL),
+              7);
+}
+
+static struct ml_queue_t started_queue;
+static int lanes_order[16];
+static atomic_int lanes_order_index;
+
+static void test_lanes_blocking_entry(void *arg_p)
+{
+    void *message_p;
+
+    ml_queue_put(&started_queue, ml_message_alloc(&mid, 0));
+    ASSERT_EQ(ml_queue_get((struct ml_queue_t *)arg_p, &message_p), &mid);
+    ml_message_free(message_p);
+}
+
+static void test_lanes_entry(void *arg_p)
+{
+    int index;
+
+    index = atomic_fetch_add(&lanes_order_index, 1);
+    lanes_order[index] = (int)(intptr_t)arg_p;
+
+    if (index == 15) {
+        ml_queue_put(&queue, ml_message_alloc(&mid, 0));
+    }
+}
+
+static void run_lanes(int blocking_lane)
+{
+    struct ml_queue_t blocker;
+    void *message_p;
+    int i;
+
+    ml_queue_init(&blocker, 1);
+    ml_queue_init(&started_queue, 1);
+    ml_queue_init(&queue, 1);
+    atomic_store(&lanes_order_index, 0);
+
+    /* Spawn all jobs while the only worker is blocked. */
+    ml_worker_pool_spawn_lane(&worker_pool,
+                              blocking_lane,
+                              test_lanes_blocking_entry,
+                              &blocker);
+    ASSERT_EQ(ml_queue_get(&started_queue, &message_p), &mid);
+    ml_message_free(message_p);
+
+    for (i = 0; i < 8; i++) {
+        ml_worker_pool_spawn_lane(&worker_pool,
+                                  1,
+                                  test_lanes_entry,
+                                  (void *)1);
+    }
+
+    for (i = 0; i < 8; i++) {
+        ml_worker_pool_spawn_lane(&worker_pool,
+                                  0,
+                                  test_lanes_entry,
+                                  (void *)0);
+    }
+
+    ml_queue_put(&blocker, ml_message_alloc(&mid, 0));
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+}
+
+TEST(lanes_strict)
+{
+    struct ml_worker_pool_lane_statistics_t statistics;
+    int i;
+
+    ml_worker_pool_init_lanes(&worker_pool, 1, 16, 2, NULL);
+    ml_worker_pool_set_lane_statistics(&worker_pool, true);
+    run_lanes(0);
+
+    for (i = 0; i < 16; i++) {
+        ASSERT_EQ(lanes_order[i], i / 8);
+    }
+
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    ASSERT_EQ(statistics.depth, 0);
+    ASSERT_EQ(statistics.number_of_jobs, 9);
+    ASSERT_GE(statistics.max_wait_time, 1);
+    ASSERT_GE(statistics.total_wait_time, statistics.max_wait_time);
+    ml_worker_pool_get_lane_statistics(&worker_pool, 1, &statistics);
+    ASSERT_EQ(statistics.number_of_jobs, 8);
+}
+
+static void test_lane_statistics_entry(void *arg_p)
+{
+    (void)arg_p;
+
+    ml_queue_put(&queue, ml_message_alloc(&mid, 0));
+}
+
+TEST(lane_statistics_disabled_by_default)
+{
+    struct ml_worker_pool_lane_statistics_t statistics;
+    void *message_p;
+
+    ml_queue_init(&queue, 1);
+    ml_worker_pool_init(&worker_pool, 1, 4);
+
+    ml_worker_pool_spawn(&worker_pool, test_lane_statistics_entry, NULL);
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    ASSERT_EQ(statistics.number_of_jobs, 0);
+
+    ml_worker_pool_set_lane_statistics(&worker_pool, true);
+    ml_worker_pool_spawn(&worker_pool, test_lane_statistics_entry, NULL);
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+    ml_worker_pool_get_lane_statistics(&worker_pool, 0, &statistics);
+    ASSERT_EQ(statistics.number_of_jobs, 1);
+}
+
+static int overflow_lanes_order[24];
+
+static void test_overflow_lanes_entry(void *arg_p)
+{
+    int index;
+
+    index = atomic_fetch_add(&lanes_order_index, 1);
+    overflow_lanes_order[index] = (int)(intptr_t)arg_p;
+
+    if (index == 23) {
+        ml_queue_put(&queue, ml_message_alloc(&mid, 0));
+    }
+}
+
+TEST(lanes_strict_overflow_before_lower_lanes)
+{
+    struct ml_worker_pool_job_t jobs[16];
+    struct ml_queue_t blocker;
+    void *message_p;
+    int i;
+
+    ml_worker_pool_init_lanes(&worker_pool, 1, 8, 2, NULL);
+    ml_queue_init(&blocker, 1);
+    ml_queue_init(&started_queue, 1);
+    ml_queue_init(&queue, 1);
+    atomic_store(&lanes_order_index, 0);
+
+    ml_worker_pool_spawn(&worker_pool, test_lanes_blocking_entry, &blocker);
+    ASSERT_EQ(ml_queue_get(&started_queue, &message_p), &mid);
+    ml_message_free(message_p);
+
+    for (i = 0; i < 8; i++) {
+        ml_worker_pool_spawn_lane(&worker_pool,
+                                  1,
+                                  test_overflow_lanes_entry,
+                                  (void *)1);
+    }
+
+    /* Half of the lane zero(0) jobs are put in the overflow list. */
+    for (i = 0; i < 16; i++) {
+        ml_worker_pool_job_init(&jobs[i], test_overflow_lanes_entry, NULL);
+        ml_worker_pool_spawn_job(&worker_pool, &jobs[i]);
+    }
+
+    ASSERT_NE(atomic_load(&worker_pool.overflow_p), NULL);
+    ml_queue_put(&blocker, ml_message_alloc(&mid, 0));
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+
+    for (i = 0; i < 24; i++) {
+        ASSERT_EQ(overflow_lanes_order[i], i / 16);
+    }
+}
+
+TEST(lanes_weighted)
+{
+    static const int weights[] = { 3, 1 };
+    static const int expected_order[] = {
+        0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1, 1, 1, 1, 1, 1
+    };
+    int i;
+
+    ml_worker_pool_init_lanes(&worker_pool, 1, 16, 2, &weights[0]);
+    run_lanes(1);
+
+    for (i = 0; i < 16; i++) {
+        ASSERT_EQ(lanes_order[i], expected_order[i]);
+    }
+}
+
+static void test_elastic_entry(void *arg_p)
+{
+    struct ml_queue_t *blocker_p;
+    void *message_p;
+
+    blocker_p = (struct ml_queue_t *)arg_p;
+    ml_queue_put(&started_queue, ml_message_alloc(&mid, 0));
+    ml_queue_get(blocker_p, &message_p);
+    ml_message_free(message_p);
+}
+
+TEST(elastic)
+{
+    struct ml_queue_t blocker;
+    void *message_p;
+    int number_of_cpus;
+    int i;
+
+    number_of_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    ml_queue_init(&blocker, 64);
+    ml_queue_init(&started_queue, 4);
+    ml_worker_pool_init_elastic(&worker_pool,
+                                1,
+                                number_of_cpus + 2,
+                                50,
+                                4,
+                                NULL);
+    ASSERT_EQ(ml_worker_pool_get_number_of_workers(&worker_pool),
+              number_of_cpus);
+
+    /* Workers are added as long as all workers are blocked. */
+    for (i = 0; i < number_of_cpus + 2; i++) {
+        ml_worker_pool_spawn(&worker_pool, test_elastic_entry, &blocker);
+        ASSERT_EQ(ml_queue_get(&started_queue, &message_p), &mid);
+        ml_message_free(message_p);
+    }
+
+    ASSERT_EQ(ml_worker_pool_get_number_of_workers(&worker_pool),
+              number_of_cpus + 2);
+
+    for (i = 0; i < number_of_cpus + 2; i++) {
+        ml_queue_put(&blocker, ml_message_alloc(&mid, 0));
+    }
+
+    /* Idle workers exit down to the minimum. */
+    for (i = 0; i < 100; i++) {
+        if (ml_worker_pool_get_number_of_workers(&worker_pool) == 1) {
+            break;
+        }
+
+        usleep(10000);
+    }
+
+    ASSERT_EQ(ml_worker_pool_get_number_of_workers(&worker_pool), 1);
+
+    /* Still works. */
+    ml_worker_pool_spawn(&worker_pool, test_elastic_entry, &blocker);
+    ASSERT_EQ(ml_queue_get(&started_queue, &message_p), &mid);
+    ml_message_free(message_p);
+    ml_queue_put(&blocker, ml_message_alloc(&mid, 0));
+}
+
+static void test_retire_entry(void *arg_p)
+{
+    ml_queue_put((struct ml_queue_t *)arg_p, ml_message_alloc(&mid, 0));
+}
+
+TEST(elastic_retire_while_spawning)
+{
+    void *message_p;
+    int i;
+
+    ml_queue_init(&queue, 1);
+
+    /* The only worker retires as soon as it is idle, racing with jobs
+       spawned meanwhile. A job must never be left without a
+       worker. */
+    ml_worker_pool_init_elastic(&worker_pool, 0, 1, 0, 4, NULL);
+
+    for (i = 0; i < 2000; i++) {
+        ml_worker_pool_spawn(&worker_pool, test_retire_entry, &queue);
+        ASSERT_EQ(ml_queue_get_timeout(&queue, &message_p, 5000), &mid);
+        ml_message_free(message_p);
+    }
+
+    /* Retired worker threads are joined before their slot is
+       reused. */
+    ASSERT_NE(worker_pool.pthreads_p[0], 0);
+}
+
+static void test_affinity_entry(void *arg_p)
+{
+    cpu_set_t cpus;
+
+    (void)arg_p;
+
+    sched_getaffinity(0, sizeof(cpus), &cpus);
+
+    if ((CPU_COUNT(&cpus) == 1) && CPU_ISSET(0, &cpus)) {
+        ml_queue_put(&queue, ml_message_alloc(&mid, 0));
+    }
+}
+
+TEST(affinity)
+{
+    static const int cpus[] = { 0 };
+    void *message_p;
+
+    ml_queue_init(&queue, 1);
+    ml_worker_pool_init_elastic(&worker_pool, 1, 1, 50, 4, &cpus[0]);
+    ml_worker_pool_spawn(&worker_pool, test_affinity_entry, NULL);
+    ASSERT_EQ(ml_queue_get(&queue, &message_p), &mid);
+    ml_message_free(message_p);
+}